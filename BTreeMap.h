@@ -0,0 +1,843 @@
+#ifndef AISDI_MAPS_BTREEMAP_H
+#define AISDI_MAPS_BTREEMAP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <initializer_list>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace aisdi
+{
+
+// B+ tree: pairs live only in the leaves, which are linked for in-order walks,
+// inner nodes keep just separator keys. Nodes span a few cache lines, so a lookup
+// touches log_B(n) nodes instead of the log_2(n) of the AVL TreeMap.
+template <typename KeyType, typename ValueType>
+class BTreeMap
+{
+public:
+  using key_type = KeyType;
+  using mapped_type = ValueType;
+  using value_type = std::pair<const key_type, mapped_type>;
+  using size_type = std::size_t;
+  using reference = value_type&;
+  using const_reference = const value_type&;
+
+  class ConstIterator;
+  class Iterator;
+  using iterator = Iterator;
+  using const_iterator = ConstIterator;
+
+private:
+  static const size_t NODE_BYTES = 512;
+  static const size_t INNER_SLOTS = std::max<size_t>(8, NODE_BYTES/(sizeof(key_type)+sizeof(void*)));
+  static const size_t LEAF_SLOTS = std::max<size_t>(8, NODE_BYTES/sizeof(value_type));
+  static const size_t INNER_MIN = INNER_SLOTS/2;
+  static const size_t LEAF_MIN = LEAF_SLOTS/2;
+  static const size_t MAX_HEIGHT = 64;
+
+  struct NodeBase
+  {
+    size_t count; //keys in an inner node, pairs in a leaf
+    bool leaf;
+
+    explicit NodeBase(bool l) : count(0), leaf(l) {}
+  };
+
+  struct Inner : NodeBase
+  {
+    key_type keys[INNER_SLOTS];
+    NodeBase *children[INNER_SLOTS+1];
+
+    Inner() : NodeBase(false) {}
+  };
+
+  struct Leaf : NodeBase
+  {
+    Leaf *prev;
+    Leaf *next;
+    alignas(value_type) unsigned char storage[LEAF_SLOTS*sizeof(value_type)];
+
+    Leaf() : NodeBase(true), prev(nullptr), next(nullptr) {}
+
+    ~Leaf()
+    {
+      for(size_t i=0;i<this->count;++i)
+        slot(i)->~value_type();
+    }
+
+    value_type* slot(size_t i)
+    {
+      return reinterpret_cast<value_type*>(storage)+i;
+    }
+
+    const value_type* slot(size_t i) const
+    {
+      return reinterpret_cast<const value_type*>(storage)+i;
+    }
+
+    // moves the pairs [from, count) one slot to the right, slot from is left unconstructed
+    void shift_right(size_t from)
+    {
+      for(size_t i=this->count;i>from;--i)
+      {
+        new (slot(i)) value_type(std::move(*slot(i-1)));
+        slot(i-1)->~value_type();
+      }
+    }
+
+    // moves the pairs (from, count) one slot to the left over the unconstructed slot from
+    void shift_left(size_t from)
+    {
+      for(size_t i=from+1;i<this->count;++i)
+      {
+        new (slot(i-1)) value_type(std::move(*slot(i)));
+        slot(i)->~value_type();
+      }
+    }
+  };
+
+  struct PathEntry
+  {
+    Inner *node;
+    size_t index; //child taken on the way down
+  };
+
+  NodeBase *root;
+  Leaf *head;
+  Leaf *tail;
+  size_type Size;
+
+public:
+  BTreeMap() : root(nullptr), head(nullptr), tail(nullptr), Size(0) {}
+
+  BTreeMap(std::initializer_list<value_type> list) : BTreeMap()
+  {
+    for(auto it=list.begin();it!=list.end();++it)
+      this->operator[](it->first)=it->second;
+  }
+
+  BTreeMap(const BTreeMap& other) : BTreeMap()
+  {
+    copy_from(other);
+  }
+
+  BTreeMap(BTreeMap&& other) noexcept : root(other.root), head(other.head), tail(other.tail), Size(other.Size)
+  {
+    other.root=nullptr;
+    other.head=other.tail=nullptr;
+    other.Size=0;
+  }
+
+  ~BTreeMap()
+  {
+    remove_all(root);
+  }
+
+  // leaves this map as it was if copying throws
+  BTreeMap& operator=(const BTreeMap& other)
+  {
+    if(this==&other) return *this;
+    BTreeMap copy(other);
+    return *this=std::move(copy);
+  }
+
+  BTreeMap& operator=(BTreeMap&& other) noexcept
+  {
+    if(this==&other) return *this;
+    remove_all(root);
+
+    root=other.root;
+    head=other.head;
+    tail=other.tail;
+    Size=other.Size;
+
+    other.root=nullptr;
+    other.head=other.tail=nullptr;
+    other.Size=0;
+
+    return *this;
+  }
+
+  bool isEmpty() const
+  {
+    return !Size;
+  }
+
+  mapped_type& operator[](const key_type& key)
+  {
+    if(root==nullptr)
+      root=head=tail=new Leaf;
+
+    PathEntry path[MAX_HEIGHT];
+    size_t depth=0;
+    Leaf *leaf=descend(key,path,depth);
+    size_t pos=leaf_position(leaf,key);
+    if(pos<leaf->count && !(key < leaf->slot(pos)->first))
+      return leaf->slot(pos)->second;
+
+    if(leaf->count==LEAF_SLOTS)
+    {
+      Leaf *right=split_leaf(leaf);
+      insert_in_parent(path,depth,leaf,right->slot(0)->first,right);
+      if(pos>leaf->count)
+      {
+        pos-=leaf->count;
+        leaf=right;
+      }
+    }
+
+    leaf->shift_right(pos);
+    try
+    {
+      new (leaf->slot(pos)) value_type(key,mapped_type{});
+    }
+    catch(...)
+    {
+      ++leaf->count;
+      leaf->shift_left(pos);
+      --leaf->count;
+      throw;
+    }
+    ++leaf->count;
+    ++Size;
+    return leaf->slot(pos)->second;
+  }
+
+  const mapped_type& valueOf(const key_type& key) const
+  {
+    const value_type *found=find_pair(key);
+    if(found==nullptr)
+      throw std::out_of_range("valueOf");
+    return found->second;
+  }
+
+  mapped_type& valueOf(const key_type& key)
+  {
+    value_type *found=find_pair(key);
+    if(found==nullptr)
+      throw std::out_of_range("valueOf");
+    return found->second;
+  }
+
+  const_iterator find(const key_type& key) const
+  {
+    if(root==nullptr) return end();
+    Leaf *leaf=find_leaf(key);
+    size_t pos=leaf_position(leaf,key);
+    if(pos<leaf->count && !(key < leaf->slot(pos)->first))
+      return ConstIterator(leaf,pos,this);
+    return end();
+  }
+
+  iterator find(const key_type& key)
+  {
+    const BTreeMap *self=this;
+    return Iterator(self->find(key));
+  }
+
+  void remove(const key_type& key)
+  {
+    if(root==nullptr)
+      throw std::out_of_range("remove");
+
+    PathEntry path[MAX_HEIGHT];
+    size_t depth=0;
+    Leaf *leaf=descend(key,path,depth);
+    size_t pos=leaf_position(leaf,key);
+    if(pos==leaf->count || key < leaf->slot(pos)->first)
+      throw std::out_of_range("remove");
+    erase_at(path,depth,leaf,pos);
+  }
+
+  void remove(const const_iterator& it)
+  {
+    if(it.leaf==nullptr || it.tree!=this)
+      throw std::out_of_range("remove");
+    remove(it.leaf->slot(it.index)->first);
+  }
+
+  size_type getSize() const
+  {
+    return Size;
+  }
+
+  bool operator==(const BTreeMap& other) const
+  {
+    if(Size!=other.Size) return false;
+    for(auto it=begin(),ito=other.begin();it!=end();++it,++ito)
+    {
+      if(*it!=*ito) return false;
+    }
+    return true;
+  }
+
+  bool operator!=(const BTreeMap& other) const
+  {
+    return !(*this == other);
+  }
+
+  iterator begin()
+  {
+    return Iterator(head,0,this);
+  }
+
+  iterator end()
+  {
+    return Iterator(nullptr,0,this);
+  }
+
+  const_iterator cbegin() const
+  {
+    return ConstIterator(head,0,this);
+  }
+
+  const_iterator cend() const
+  {
+    return ConstIterator(nullptr,0,this);
+  }
+
+  const_iterator begin() const
+  {
+    return cbegin();
+  }
+
+  const_iterator end() const
+  {
+    return cend();
+  }
+
+private:
+
+  // Arithmetic keys are counted with a branchless scan over the whole node, which the
+  // compiler turns into SIMD compares; anything else falls back to binary search.
+
+  // index of the child which may hold key: number of separators <= key
+  static size_t child_index(const Inner *node, const key_type& key)
+  {
+    return child_index(node,key,std::is_arithmetic<key_type>());
+  }
+
+  static size_t child_index(const Inner *node, const key_type& key, std::true_type)
+  {
+    size_t index=0;
+    for(size_t i=0;i<node->count;++i)
+      index+=!(key < node->keys[i]);
+    return index;
+  }
+
+  static size_t child_index(const Inner *node, const key_type& key, std::false_type)
+  {
+    return size_t(std::upper_bound(node->keys,node->keys+node->count,key)-node->keys);
+  }
+
+  // first pair in the leaf whose key is not less than key
+  static size_t leaf_position(const Leaf *leaf, const key_type& key)
+  {
+    return leaf_position(leaf,key,std::is_arithmetic<key_type>());
+  }
+
+  static size_t leaf_position(const Leaf *leaf, const key_type& key, std::true_type)
+  {
+    size_t index=0;
+    for(size_t i=0;i<leaf->count;++i)
+      index+=(leaf->slot(i)->first < key);
+    return index;
+  }
+
+  static size_t leaf_position(const Leaf *leaf, const key_type& key, std::false_type)
+  {
+    size_t low=0, high=leaf->count;
+    while(low<high)
+    {
+      size_t mid=(low+high)/2;
+      if(leaf->slot(mid)->first < key) low=mid+1;
+      else high=mid;
+    }
+    return low;
+  }
+
+  static Inner* as_inner(NodeBase *node)
+  {
+    return static_cast<Inner*>(node);
+  }
+
+  static Leaf* as_leaf(NodeBase *node)
+  {
+    return static_cast<Leaf*>(node);
+  }
+
+  Leaf* find_leaf(const key_type& key) const
+  {
+    NodeBase *node=root;
+    while(!node->leaf)
+      node=as_inner(node)->children[child_index(as_inner(node),key)];
+    return as_leaf(node);
+  }
+
+  value_type* find_pair(const key_type& key) const
+  {
+    if(root==nullptr) return nullptr;
+    Leaf *leaf=find_leaf(key);
+    size_t pos=leaf_position(leaf,key);
+    if(pos<leaf->count && !(key < leaf->slot(pos)->first))
+      return leaf->slot(pos);
+    return nullptr;
+  }
+
+  Leaf* descend(const key_type& key, PathEntry *path, size_t& depth)
+  {
+    NodeBase *node=root;
+    while(!node->leaf)
+    {
+      Inner *inner=as_inner(node);
+      size_t index=child_index(inner,key);
+      path[depth].node=inner;
+      path[depth].index=index;
+      ++depth;
+      node=inner->children[index];
+    }
+    return as_leaf(node);
+  }
+
+  // moves the upper half of a full leaf into a new leaf linked after it
+  Leaf* split_leaf(Leaf *leaf)
+  {
+    Leaf *right=new Leaf;
+    size_t keep=LEAF_SLOTS/2;
+    for(size_t i=keep;i<leaf->count;++i)
+    {
+      new (right->slot(i-keep)) value_type(std::move(*leaf->slot(i)));
+      leaf->slot(i)->~value_type();
+    }
+    right->count=leaf->count-keep;
+    leaf->count=keep;
+
+    right->next=leaf->next;
+    right->prev=leaf;
+    if(leaf->next) leaf->next->prev=right;
+    else tail=right;
+    leaf->next=right;
+    return right;
+  }
+
+  // hooks right in as the sibling after left, splitting inner nodes up the path as needed
+  void insert_in_parent(PathEntry *path, size_t depth, NodeBase *left, key_type separator, NodeBase *right)
+  {
+    while(depth>0)
+    {
+      Inner *parent=path[depth-1].node;
+      size_t index=path[depth-1].index;
+      --depth;
+
+      if(parent->count<INNER_SLOTS)
+      {
+        insert_separator(parent,index,separator,right);
+        return;
+      }
+
+      key_type keys[INNER_SLOTS+1];
+      NodeBase *children[INNER_SLOTS+2];
+      std::move(parent->keys,parent->keys+index,keys);
+      keys[index]=std::move(separator);
+      std::move(parent->keys+index,parent->keys+INNER_SLOTS,keys+index+1);
+      std::copy(parent->children,parent->children+index+1,children);
+      children[index+1]=right;
+      std::copy(parent->children+index+1,parent->children+INNER_SLOTS+1,children+index+2);
+
+      Inner *sibling=new Inner;
+      size_t keep=INNER_SLOTS/2;
+      std::move(keys,keys+keep,parent->keys);
+      std::copy(children,children+keep+1,parent->children);
+      parent->count=keep;
+      std::move(keys+keep+1,keys+INNER_SLOTS+1,sibling->keys);
+      std::copy(children+keep+1,children+INNER_SLOTS+2,sibling->children);
+      sibling->count=INNER_SLOTS-keep;
+
+      left=parent;
+      separator=std::move(keys[keep]);
+      right=sibling;
+    }
+
+    Inner *new_root=new Inner;
+    new_root->keys[0]=std::move(separator);
+    new_root->children[0]=left;
+    new_root->children[1]=right;
+    new_root->count=1;
+    root=new_root;
+  }
+
+  static void insert_separator(Inner *node, size_t index, const key_type& separator, NodeBase *right)
+  {
+    std::move_backward(node->keys+index,node->keys+node->count,node->keys+node->count+1);
+    std::move_backward(node->children+index+1,node->children+node->count+1,node->children+node->count+2);
+    node->keys[index]=separator;
+    node->children[index+1]=right;
+    ++node->count;
+  }
+
+  static void erase_separator(Inner *node, size_t index)
+  {
+    std::move(node->keys+index+1,node->keys+node->count,node->keys+index);
+    std::move(node->children+index+2,node->children+node->count+1,node->children+index+1);
+    --node->count;
+  }
+
+  void erase_at(PathEntry *path, size_t depth, Leaf *leaf, size_t pos)
+  {
+    leaf->slot(pos)->~value_type();
+    leaf->shift_left(pos);
+    --leaf->count;
+    --Size;
+
+    if(depth==0)
+    {
+      if(leaf->count==0)
+      {
+        delete leaf;
+        root=head=tail=nullptr;
+      }
+      return;
+    }
+    if(leaf->count>=LEAF_MIN) return;
+
+    Inner *parent=path[depth-1].node;
+    size_t index=path[depth-1].index;
+    if(index>0 && as_leaf(parent->children[index-1])->count>LEAF_MIN)
+    {
+      Leaf *left=as_leaf(parent->children[index-1]);
+      leaf->shift_right(0);
+      new (leaf->slot(0)) value_type(std::move(*left->slot(left->count-1)));
+      left->slot(--left->count)->~value_type();
+      ++leaf->count;
+      parent->keys[index-1]=leaf->slot(0)->first;
+      return;
+    }
+    if(index<parent->count && as_leaf(parent->children[index+1])->count>LEAF_MIN)
+    {
+      Leaf *right=as_leaf(parent->children[index+1]);
+      new (leaf->slot(leaf->count++)) value_type(std::move(*right->slot(0)));
+      right->slot(0)->~value_type();
+      right->shift_left(0);
+      --right->count;
+      parent->keys[index]=right->slot(0)->first;
+      return;
+    }
+
+    if(index>0) merge_leaves(as_leaf(parent->children[index-1]),leaf);
+    else merge_leaves(leaf,as_leaf(parent->children[index+1]));
+    erase_separator(parent,index>0 ? index-1 : index);
+    fix_inner(path,depth-1);
+  }
+
+  // appends right to left and unlinks it
+  void merge_leaves(Leaf *left, Leaf *right)
+  {
+    for(size_t i=0;i<right->count;++i)
+    {
+      new (left->slot(left->count+i)) value_type(std::move(*right->slot(i)));
+      right->slot(i)->~value_type();
+    }
+    left->count+=right->count;
+    right->count=0;
+
+    left->next=right->next;
+    if(right->next) right->next->prev=left;
+    else tail=left;
+    delete right;
+  }
+
+  // restores the minimal fill of path[depth].node after one of its separators was erased
+  void fix_inner(PathEntry *path, size_t depth)
+  {
+    while(true)
+    {
+      Inner *node=path[depth].node;
+      if(depth==0)
+      {
+        if(node->count==0)
+        {
+          root=node->children[0];
+          delete node;
+        }
+        return;
+      }
+      if(node->count>=INNER_MIN) return;
+
+      Inner *parent=path[depth-1].node;
+      size_t index=path[depth-1].index;
+      if(index>0 && as_inner(parent->children[index-1])->count>INNER_MIN)
+      {
+        Inner *left=as_inner(parent->children[index-1]);
+        std::move_backward(node->keys,node->keys+node->count,node->keys+node->count+1);
+        std::move_backward(node->children,node->children+node->count+1,node->children+node->count+2);
+        node->keys[0]=std::move(parent->keys[index-1]);
+        node->children[0]=left->children[left->count];
+        parent->keys[index-1]=std::move(left->keys[left->count-1]);
+        --left->count;
+        ++node->count;
+        return;
+      }
+      if(index<parent->count && as_inner(parent->children[index+1])->count>INNER_MIN)
+      {
+        Inner *right=as_inner(parent->children[index+1]);
+        node->keys[node->count]=std::move(parent->keys[index]);
+        node->children[node->count+1]=right->children[0];
+        ++node->count;
+        parent->keys[index]=std::move(right->keys[0]);
+        std::move(right->keys+1,right->keys+right->count,right->keys);
+        std::move(right->children+1,right->children+right->count+1,right->children);
+        --right->count;
+        return;
+      }
+
+      size_t separator= index>0 ? index-1 : index;
+      Inner *left=as_inner(parent->children[separator]);
+      Inner *right=as_inner(parent->children[separator+1]);
+      left->keys[left->count]=std::move(parent->keys[separator]);
+      std::move(right->keys,right->keys+right->count,left->keys+left->count+1);
+      std::copy(right->children,right->children+right->count+1,left->children+left->count+1);
+      left->count+=right->count+1;
+      delete right;
+      erase_separator(parent,separator);
+      --depth;
+    }
+  }
+
+  void remove_all(NodeBase *node)
+  {
+    destroy(node);
+    root=nullptr;
+    head=tail=nullptr;
+    Size=0;
+  }
+
+  static void destroy(NodeBase *node)
+  {
+    if(node==nullptr) return;
+    if(node->leaf)
+    {
+      delete as_leaf(node);
+      return;
+    }
+    Inner *inner=as_inner(node);
+    for(size_t i=0;i<=inner->count;++i)
+      destroy(inner->children[i]);
+    delete inner;
+  }
+
+  // copies the structure node by node; leaves are relinked in the order they are cloned.
+  // Only for an empty map: if a copy throws, what was cloned is freed and the map stays empty
+  void copy_from(const BTreeMap& other)
+  {
+    Leaf *last=nullptr;
+    try
+    {
+      root=clone(other.root,last);
+    }
+    catch(...)
+    {
+      head=nullptr;
+      throw;
+    }
+    tail=last;
+    Size=other.Size;
+  }
+
+  NodeBase* clone(const NodeBase *node, Leaf *&last)
+  {
+    if(node==nullptr) return nullptr;
+    if(node->leaf)
+    {
+      const Leaf *source=static_cast<const Leaf*>(node);
+      Leaf *copy=new Leaf;
+      try
+      {
+        for(;copy->count<source->count;++copy->count)
+          new (copy->slot(copy->count)) value_type(*source->slot(copy->count));
+      }
+      catch(...)
+      {
+        delete copy;
+        throw;
+      }
+      copy->prev=last;
+      if(last) last->next=copy;
+      else head=copy;
+      last=copy;
+      return copy;
+    }
+    const Inner *source=static_cast<const Inner*>(node);
+    Inner *copy=new Inner;
+    size_t cloned=0;
+    try
+    {
+      std::copy(source->keys,source->keys+source->count,copy->keys);
+      for(;cloned<=source->count;++cloned)
+        copy->children[cloned]=clone(source->children[cloned],last);
+    }
+    catch(...)
+    {
+      for(size_t i=0;i<cloned;++i)
+        destroy(copy->children[i]);
+      delete copy;
+      throw;
+    }
+    copy->count=source->count;
+    return copy;
+  }
+};
+
+template <typename KeyType, typename ValueType>
+class BTreeMap<KeyType, ValueType>::ConstIterator
+{
+public:
+  using reference = typename BTreeMap::const_reference;
+  using iterator_category = std::bidirectional_iterator_tag;
+  using value_type = typename BTreeMap::value_type;
+  using pointer = const typename BTreeMap::value_type*;
+
+private:
+  Leaf *leaf;
+  size_t index;
+  const BTreeMap *tree;
+
+  friend class BTreeMap<KeyType, ValueType>;
+
+public:
+  explicit ConstIterator(Leaf *l=nullptr, size_t i=0, const BTreeMap *t=nullptr) : leaf(l), index(i), tree(t)
+  {}
+
+  ConstIterator(const ConstIterator& other) : ConstIterator(other.leaf,other.index,other.tree) {}
+
+  ConstIterator& operator++()
+  {
+    if(leaf==nullptr)
+      throw std::out_of_range("++");
+
+    if(++index==leaf->count)
+    {
+      leaf=leaf->next;
+      index=0;
+    }
+    return *this;
+  }
+
+  ConstIterator operator++(int)
+  {
+    ConstIterator tmp=*this;
+    operator++();
+    return tmp;
+  }
+
+  ConstIterator& operator--()
+  {
+    if(leaf==nullptr)
+    {
+      if(tree==nullptr || tree->tail==nullptr)
+        throw std::out_of_range("--");
+      leaf=tree->tail;
+      index=leaf->count-1;
+      return *this;
+    }
+    if(index>0)
+    {
+      --index;
+      return *this;
+    }
+    if(leaf->prev==nullptr)
+      throw std::out_of_range("--");
+    leaf=leaf->prev;
+    index=leaf->count-1;
+    return *this;
+  }
+
+  ConstIterator operator--(int)
+  {
+    ConstIterator tmp=*this;
+    operator--();
+    return tmp;
+  }
+
+  reference operator*() const
+  {
+    if(leaf==nullptr)
+      throw std::out_of_range("");
+
+    return *leaf->slot(index);
+  }
+
+  pointer operator->() const
+  {
+    return &this->operator*();
+  }
+
+  bool operator==(const ConstIterator& other) const
+  {
+    return leaf==other.leaf && index==other.index && (leaf==nullptr || tree==other.tree);
+  }
+
+  bool operator!=(const ConstIterator& other) const
+  {
+    return !(*this == other);
+  }
+};
+
+template <typename KeyType, typename ValueType>
+class BTreeMap<KeyType, ValueType>::Iterator : public BTreeMap<KeyType, ValueType>::ConstIterator
+{
+public:
+  using reference = typename BTreeMap::reference;
+  using pointer = typename BTreeMap::value_type*;
+
+  explicit Iterator(Leaf *l=nullptr, size_t i=0, const BTreeMap *t=nullptr) : ConstIterator(l,i,t)
+  {}
+
+  Iterator(const ConstIterator& other)
+    : ConstIterator(other)
+  {}
+
+  Iterator& operator++()
+  {
+    ConstIterator::operator++();
+    return *this;
+  }
+
+  Iterator operator++(int)
+  {
+    auto result = *this;
+    ConstIterator::operator++();
+    return result;
+  }
+
+  Iterator& operator--()
+  {
+    ConstIterator::operator--();
+    return *this;
+  }
+
+  Iterator operator--(int)
+  {
+    auto result = *this;
+    ConstIterator::operator--();
+    return result;
+  }
+
+  pointer operator->() const
+  {
+    return &this->operator*();
+  }
+
+  reference operator*() const
+  {
+    // ugly cast, yet reduces code duplication.
+    return const_cast<reference>(ConstIterator::operator*());
+  }
+};
+
+}
+
+#endif /* AISDI_MAPS_BTREEMAP_H */
@@ -0,0 +1,330 @@
+#ifndef AISDI_MAPS_BENCHMARK_H
+#define AISDI_MAPS_BENCHMARK_H
+
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <ostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace aisdi
+{
+namespace bench
+{
+
+using Clock = std::chrono::steady_clock;
+
+struct Options
+{
+  std::size_t keys = 100000;
+  std::size_t repetitions = 5;
+  std::size_t warmup = 1;
+  std::size_t threads = std::max(1u, std::thread::hardware_concurrency()); //most threads the scaling benchmarks use
+  std::string format = "text"; //text, csv or json
+  std::string filter; //only run benchmarks whose "map/scenario/distribution" contains it
+};
+
+// accepts --keys=N --reps=N --warmup=N --threads=N --format=F --filter=S;
+// a bare number is taken as the key count, as the old main did
+inline Options parseOptions(int argc, char** argv)
+{
+  Options options;
+  for(int i=1;i<argc;++i)
+  {
+    std::string arg=argv[i];
+    std::string value=arg.substr(arg.find('=')+1);
+    if(arg.compare(0,7,"--keys=")==0) options.keys=std::stoull(value);
+    else if(arg.compare(0,7,"--reps=")==0) options.repetitions=std::stoull(value);
+    else if(arg.compare(0,9,"--warmup=")==0) options.warmup=std::stoull(value);
+    else if(arg.compare(0,10,"--threads=")==0) options.threads=std::stoull(value);
+    else if(arg.compare(0,9,"--format=")==0) options.format=value;
+    else if(arg.compare(0,9,"--filter=")==0) options.filter=value;
+    else if(!arg.empty() && std::isdigit(static_cast<unsigned char>(arg[0]))) options.keys=std::stoull(arg);
+    else throw std::invalid_argument("unknown option: "+arg);
+  }
+  if(options.format!="text" && options.format!="csv" && options.format!="json")
+    throw std::invalid_argument("unknown format: "+options.format);
+  if(options.repetitions==0 || options.keys==0 || options.threads==0)
+    throw std::invalid_argument("--keys, --reps and --threads must be positive");
+  return options;
+}
+
+// keeps the optimizer from dropping work whose result is otherwise unused
+template <typename T>
+inline void consume(const T& value)
+{
+#if defined(__GNUC__)
+  asm volatile("" : : "r,m"(value) : "memory");
+#else
+  static volatile const void *sink;
+  sink=&value;
+#endif
+}
+
+struct Result
+{
+  std::string map;
+  std::string scenario;
+  std::string distribution;
+  std::size_t keys;
+  std::size_t ops; //operations per repetition
+  std::vector<double> ns_per_op; //one sample per measured repetition, sorted
+  double median;
+  double p99;
+  double min;
+  double mean;
+
+  double opsPerSecond() const
+  {
+    return median>0 ? 1e9/median : 0;
+  }
+};
+
+// median and nearest-rank p99 over the repetitions
+inline void summarize(Result& result)
+{
+  std::vector<double>& samples=result.ns_per_op;
+  std::sort(samples.begin(),samples.end());
+  std::size_t n=samples.size();
+  result.median= n%2 ? samples[n/2] : (samples[n/2-1]+samples[n/2])/2;
+  result.p99=samples[std::size_t(std::ceil(0.99*n))-1];
+  result.min=samples.front();
+  double sum=0;
+  for(double sample : samples) sum+=sample;
+  result.mean=sum/n;
+}
+
+class Runner
+{
+public:
+  Runner(const Options& o, std::ostream& output) : options(o), out(output), printed(0)
+  {
+    if(options.format=="csv")
+      out<<"map,scenario,distribution,keys,ops,repetitions,median_ns_per_op,p99_ns_per_op,min_ns_per_op,mean_ns_per_op,ops_per_s\n";
+    else if(options.format=="json")
+      out<<"[\n";
+    else
+      out<<std::left<<std::setw(20)<<"map"<<std::setw(20)<<"scenario"<<std::setw(13)<<"distribution"
+         <<std::right<<std::setw(10)<<"keys"<<std::setw(14)<<"median ns/op"<<std::setw(13)<<"p99 ns/op"
+         <<std::setw(13)<<"min ns/op"<<std::setw(15)<<"ops/s"<<'\n';
+  }
+
+  Runner(const Runner&) = delete;
+  Runner& operator=(const Runner&) = delete;
+
+  ~Runner()
+  {
+    if(options.format=="json")
+      out<<(printed ? "\n" : "")<<"]\n";
+  }
+
+  const Options& settings() const
+  {
+    return options;
+  }
+
+  bool enabled(const std::string& map, const std::string& scenario, const std::string& distribution) const
+  {
+    return options.filter.empty() || (map+"/"+scenario+"/"+distribution).find(options.filter)!=std::string::npos;
+  }
+
+  // setup runs untimed before each repetition, body is timed and returns how many operations it did
+  template <typename Setup, typename Body>
+  void run(const std::string& map, const std::string& scenario, const std::string& distribution, Setup setup, Body body)
+  {
+    if(!enabled(map,scenario,distribution)) return;
+
+    Result result;
+    result.map=map;
+    result.scenario=scenario;
+    result.distribution=distribution;
+    result.keys=options.keys;
+    result.ops=0;
+    for(std::size_t rep=0;rep<options.warmup+options.repetitions;++rep)
+    {
+      setup();
+      auto start=Clock::now();
+      std::size_t ops=body();
+      auto done=Clock::now();
+      if(rep<options.warmup || ops==0) continue;
+      result.ops=ops;
+      result.ns_per_op.push_back(std::chrono::duration<double,std::nano>(done-start).count()/ops);
+    }
+    if(result.ns_per_op.empty()) return;
+    summarize(result);
+    print(result);
+  }
+
+  template <typename Body>
+  void run(const std::string& map, const std::string& scenario, const std::string& distribution, Body body)
+  {
+    run(map,scenario,distribution,[]{},body);
+  }
+
+private:
+  Options options;
+  std::ostream& out;
+  std::size_t printed;
+
+  void print(const Result& r)
+  {
+    if(options.format=="csv")
+    {
+      out<<r.map<<','<<r.scenario<<','<<r.distribution<<','<<r.keys<<','<<r.ops<<','<<r.ns_per_op.size()<<','
+         <<r.median<<','<<r.p99<<','<<r.min<<','<<r.mean<<','<<std::fixed<<std::setprecision(0)<<r.opsPerSecond()
+         <<std::defaultfloat<<std::setprecision(6)<<'\n';
+    }
+    else if(options.format=="json")
+    {
+      out<<(printed ? ",\n" : "")<<"  {\"map\": \""<<r.map<<"\", \"scenario\": \""<<r.scenario
+         <<"\", \"distribution\": \""<<r.distribution<<"\", \"keys\": "<<r.keys<<", \"ops\": "<<r.ops
+         <<", \"repetitions\": "<<r.ns_per_op.size()<<", \"median_ns_per_op\": "<<r.median
+         <<", \"p99_ns_per_op\": "<<r.p99<<", \"min_ns_per_op\": "<<r.min<<", \"mean_ns_per_op\": "<<r.mean
+         <<", \"ops_per_s\": "<<std::fixed<<std::setprecision(0)<<r.opsPerSecond()<<std::defaultfloat<<std::setprecision(6)<<"}";
+    }
+    else
+    {
+      out<<std::left<<std::setw(20)<<r.map<<std::setw(20)<<r.scenario<<std::setw(13)<<r.distribution
+         <<std::right<<std::setw(10)<<r.keys<<std::fixed<<std::setprecision(1)<<std::setw(14)<<r.median
+         <<std::setw(13)<<r.p99<<std::setw(13)<<r.min<<std::setprecision(0)<<std::setw(15)<<r.opsPerSecond()
+         <<std::defaultfloat<<std::setprecision(6)<<'\n';
+    }
+    out.flush();
+    ++printed;
+  }
+};
+
+// runs work(thread_index) on count threads at once and waits for all of them
+template <typename Work>
+inline void runThreads(std::size_t count, Work work)
+{
+  std::vector<std::thread> workers;
+  for(std::size_t i=1;i<count;++i)
+    workers.emplace_back(work,i);
+  work(std::size_t(0));
+  for(auto& worker : workers)
+    worker.join();
+}
+
+// 1, 2, 4, ... up to and including max
+inline std::vector<std::size_t> threadCounts(std::size_t max)
+{
+  std::vector<std::size_t> counts;
+  for(std::size_t t=1;t<max;t*=2)
+    counts.push_back(t);
+  counts.push_back(max);
+  return counts;
+}
+
+// Zipf distributed ranks in [0, n) with skew theta, generator from Gray et al.
+// "Quickly generating billion-record synthetic databases" as used by YCSB
+class ZipfianGenerator
+{
+public:
+  explicit ZipfianGenerator(std::size_t n, double skew=0.99) : items(n), theta(skew)
+  {
+    double zeta2=zeta(2);
+    zetan=zeta(n);
+    alpha=1/(1-theta);
+    eta=(1-std::pow(2.0/n,1-theta))/(1-zeta2/zetan);
+  }
+
+  template <typename Rng>
+  std::size_t operator()(Rng& rng)
+  {
+    double u=std::uniform_real_distribution<double>(0,1)(rng);
+    double uz=u*zetan;
+    if(uz<1) return 0;
+    if(uz<1+std::pow(0.5,theta)) return 1;
+    std::size_t rank=std::size_t(items*std::pow(eta*u-eta+1,alpha));
+    return rank<items ? rank : items-1;
+  }
+
+private:
+  std::size_t items;
+  double theta;
+  double zetan;
+  double alpha;
+  double eta;
+
+  double zeta(std::size_t n) const
+  {
+    double sum=0;
+    for(std::size_t i=1;i<=n;++i)
+      sum+=1/std::pow(double(i),theta);
+    return sum;
+  }
+};
+
+enum class Distribution
+{
+  Sequential,  //0, 1, 2, ...
+  Random,      //uniform over 62 bits
+  Zipfian,     //skewed, hot keys repeat; ranks are scattered so hot keys are not neighbours
+  Adversarial  //multiples of 2^14, all in one bucket of an identity hashed power of two table
+};
+
+inline const char* name(Distribution distribution)
+{
+  switch(distribution)
+  {
+    case Distribution::Sequential: return "sequential";
+    case Distribution::Random: return "random";
+    case Distribution::Zipfian: return "zipfian";
+    case Distribution::Adversarial: return "adversarial";
+  }
+  return "";
+}
+
+// n keys in insertion order; all of them are even, so k|1 is guaranteed to be a miss
+inline std::vector<long> makeKeys(Distribution distribution, std::size_t n, std::uint64_t seed=42)
+{
+  std::vector<long> keys(n);
+  std::mt19937_64 rng(seed);
+  if(distribution==Distribution::Zipfian)
+  {
+    ZipfianGenerator zipf(n);
+    for(std::size_t i=0;i<n;++i)
+      keys[i]=long((zipf(rng)*0x9E3779B97F4A7C15ULL)>>2);
+  }
+  else
+  {
+    for(std::size_t i=0;i<n;++i)
+    {
+      if(distribution==Distribution::Sequential) keys[i]=long(i);
+      else if(distribution==Distribution::Random) keys[i]=long(rng()>>2);
+      else keys[i]=long(i)<<14;
+    }
+  }
+  for(std::size_t i=0;i<n;++i)
+    keys[i]*=2;
+  return keys;
+}
+
+inline std::vector<long> missKeys(const std::vector<long>& keys)
+{
+  std::vector<long> misses(keys);
+  for(std::size_t i=0;i<misses.size();++i)
+    misses[i]|=1;
+  return misses;
+}
+
+inline std::vector<long> shuffled(std::vector<long> keys, std::uint64_t seed=7)
+{
+  std::shuffle(keys.begin(),keys.end(),std::mt19937_64(seed));
+  return keys;
+}
+
+}
+}
+
+#endif /* AISDI_MAPS_BENCHMARK_H */
@@ -0,0 +1,212 @@
+#ifndef AISDI_MAPS_CONCURRENTHASHMAP_H
+#define AISDI_MAPS_CONCURRENTHASHMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <utility>
+
+#include "HashMap.h"
+
+namespace aisdi
+{
+
+// Thread safe hash map: keys are spread over independently locked shards, each a HashMap
+// behind its own reader-writer lock. Readers of one shard run in parallel, writers only
+// exclude others from their shard. Every operation is atomic for its key.
+// Hasher and KeyEqual are those of the shards' HashMaps; the hasher also picks the shard
+template <typename KeyType, typename ValueType,
+          typename Hasher = DefaultHash<KeyType>, typename KeyEqual = DefaultEqual<KeyType>>
+class ConcurrentHashMap : private StoredFunctor<Hasher, 0>
+{
+public:
+  using key_type = KeyType;
+  using mapped_type = ValueType;
+  using hasher = Hasher;
+  using key_equal = KeyEqual;
+  using value_type = std::pair<const key_type, mapped_type>;
+  using size_type = std::size_t;
+
+private:
+  using StoredHasher = StoredFunctor<hasher, 0>;
+
+  struct alignas(64) Shard
+  {
+    mutable std::shared_mutex lock;
+    HashMap<key_type, mapped_type, hasher, key_equal> map; //readers only call const members, which never write to the map,
+                                        //even with an incremental rehash pending
+  };
+
+  Shard *shards;
+  size_t SHARD_COUNT;
+
+public:
+  explicit ConcurrentHashMap(size_type shard_count=64, const hasher& hash=hasher(), const key_equal& equal=key_equal())
+    : StoredHasher(hash), shards(nullptr), SHARD_COUNT(1)
+  {
+    while(SHARD_COUNT<shard_count) SHARD_COUNT<<=1;
+    shards=new Shard[SHARD_COUNT];
+    try
+    {
+      for(size_t i=0;i<SHARD_COUNT;++i)
+        shards[i].map=HashMap<key_type, mapped_type, hasher, key_equal>(0,hash,equal);
+    }
+    catch(...)
+    {
+      delete[] shards;
+      throw;
+    }
+  }
+
+  ConcurrentHashMap(const ConcurrentHashMap&) = delete;
+  ConcurrentHashMap& operator=(const ConcurrentHashMap&) = delete;
+
+  ~ConcurrentHashMap()
+  {
+    delete[] shards;
+  }
+
+  // returns true if the key was new
+  bool insert_or_assign(const key_type& key, const mapped_type& value)
+  {
+    Shard& shard=shard_for(key);
+    std::unique_lock<std::shared_mutex> guard(shard.lock);
+    return shard.map.insert_or_assign(key,value).second;
+  }
+
+  bool insert_or_assign(const key_type& key, mapped_type&& value)
+  {
+    Shard& shard=shard_for(key);
+    std::unique_lock<std::shared_mutex> guard(shard.lock);
+    return shard.map.insert_or_assign(key,std::move(value)).second;
+  }
+
+  // inserts only if the key is absent, returns true if it did
+  bool insert(const key_type& key, const mapped_type& value)
+  {
+    Shard& shard=shard_for(key);
+    std::unique_lock<std::shared_mutex> guard(shard.lock);
+    return shard.map.try_emplace(key,value).second;
+  }
+
+  // calls visit(const mapped_type&) under the shard's shared lock, returns false on a miss
+  template <typename Visitor>
+  bool find(const key_type& key, Visitor visit) const
+  {
+    const Shard& shard=shard_for(key);
+    std::shared_lock<std::shared_mutex> guard(shard.lock);
+    auto it=shard.map.find(key);
+    if(it==shard.map.end()) return false;
+    visit(it->second);
+    return true;
+  }
+
+  // calls update(mapped_type&) under the shard's exclusive lock, returns false on a miss
+  template <typename Updater>
+  bool update(const key_type& key, Updater update)
+  {
+    Shard& shard=shard_for(key);
+    std::unique_lock<std::shared_mutex> guard(shard.lock);
+    auto it=shard.map.find(key);
+    if(it==shard.map.end()) return false;
+    update(it->second);
+    return true;
+  }
+
+  bool contains(const key_type& key) const
+  {
+    const Shard& shard=shard_for(key);
+    std::shared_lock<std::shared_mutex> guard(shard.lock);
+    return shard.map.contains(key);
+  }
+
+  // a copy, since the stored value may change as soon as the lock is released
+  mapped_type valueOf(const key_type& key) const
+  {
+    const Shard& shard=shard_for(key);
+    std::shared_lock<std::shared_mutex> guard(shard.lock);
+    auto it=shard.map.find(key);
+    if(it==shard.map.end())
+      throw std::out_of_range("valueOf");
+    return it->second;
+  }
+
+  // returns false if the key was not there
+  bool erase(const key_type& key)
+  {
+    Shard& shard=shard_for(key);
+    std::unique_lock<std::shared_mutex> guard(shard.lock);
+    return shard.map.erase(key)!=0;
+  }
+
+  // visits shard by shard, so it sees each shard consistently but not the map as a whole
+  template <typename Visitor>
+  void forEach(Visitor visit) const
+  {
+    for(size_t i=0;i<SHARD_COUNT;++i)
+    {
+      std::shared_lock<std::shared_mutex> guard(shards[i].lock);
+      for(auto it=shards[i].map.begin();it!=shards[i].map.end();++it)
+        visit(*it);
+    }
+  }
+
+  // exact only while no writer is running
+  size_type getSize() const
+  {
+    size_type size=0;
+    for(size_t i=0;i<SHARD_COUNT;++i)
+    {
+      std::shared_lock<std::shared_mutex> guard(shards[i].lock);
+      size+=shards[i].map.getSize();
+    }
+    return size;
+  }
+
+  bool isEmpty() const
+  {
+    return getSize()==0;
+  }
+
+  size_type shard_count() const
+  {
+    return SHARD_COUNT;
+  }
+
+  hasher hash_function() const
+  {
+    return StoredHasher::get();
+  }
+
+  key_equal key_eq() const
+  {
+    return shards[0].map.key_eq();
+  }
+
+private:
+
+  // the shard is picked from the top bits of a mixed hash, HashMap uses the low ones for its buckets
+  size_t shard_index(const key_type& key) const
+  {
+    std::uint64_t h=StoredHasher::get()(key);
+    h*=0x9E3779B97F4A7C15ULL;
+    return size_t(h>>32) & (SHARD_COUNT-1);
+  }
+
+  Shard& shard_for(const key_type& key)
+  {
+    return shards[shard_index(key)];
+  }
+
+  const Shard& shard_for(const key_type& key) const
+  {
+    return shards[shard_index(key)];
+  }
+};
+
+}
+
+#endif /* AISDI_MAPS_CONCURRENTHASHMAP_H */
@@ -0,0 +1,535 @@
+#ifndef AISDI_MAPS_CONCURRENTTREEMAP_H
+#define AISDI_MAPS_CONCURRENTTREEMAP_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#include "Epoch.h"
+#include "StoredFunctor.h"
+
+namespace aisdi
+{
+
+// Thread safe ordered map: a lock-free skip list. Every node sits on the bottom level and on
+// each level above with probability 1/4. A node is erased by marking the low bit of its
+// next pointers, top level first; the bottom mark is the erase itself, and whoever walks past
+// a marked node unlinks it. Readers never write and never wait. The stored pair is immutable;
+// an assignment publishes a new one. Unlinked nodes and replaced pairs are freed through
+// Epoch, so any pair a reader got stays valid until its Epoch::Guard or iterator goes away.
+// The map keeps its own Compare, like TreeMap; it is only read, so threads share it.
+template <typename KeyType, typename ValueType, typename Compare = std::less<KeyType>>
+class ConcurrentTreeMap : private StoredFunctor<Compare, 0>
+{
+public:
+  using key_type = KeyType;
+  using mapped_type = ValueType;
+  using value_type = std::pair<const key_type, mapped_type>;
+  using size_type = std::size_t;
+  using key_compare = Compare;
+  using const_reference = const value_type&;
+
+  class ConstIterator;
+  using const_iterator = ConstIterator;
+
+private:
+  using StoredCompare = StoredFunctor<key_compare, 0>;
+
+  static const int MAX_LEVEL=16; //4^16 nodes before the top level gets crowded
+  static const std::uintptr_t MARK=1;
+
+  struct Node
+  {
+    const key_type key;
+    std::atomic<const value_type*> entry;
+    std::atomic<int> owners; //the inserter and the eraser; the last one to finish with the node retires it
+    const int height;
+
+    Node(const key_type& k, const value_type *e, int h) : key(k), entry(e), owners(2), height(h) {}
+
+    // height next pointers follow the node in the same allocation
+    std::atomic<std::uintptr_t>* next()
+    {
+        return reinterpret_cast<std::atomic<std::uintptr_t>*>(this+1);
+    }
+  };
+
+  std::atomic<std::uintptr_t> head[MAX_LEVEL];
+  alignas(64) std::atomic<size_type> count;
+
+public:
+  ConcurrentTreeMap() : ConcurrentTreeMap(key_compare()) {}
+
+  explicit ConcurrentTreeMap(const key_compare& compare) : StoredCompare(compare), count(0)
+  {
+    for(int i=0;i<MAX_LEVEL;++i)
+        head[i].store(0,std::memory_order_relaxed);
+  }
+
+  ConcurrentTreeMap(const ConcurrentTreeMap&) = delete;
+  ConcurrentTreeMap& operator=(const ConcurrentTreeMap&) = delete;
+
+  // no other thread may use the map any more
+  ~ConcurrentTreeMap()
+  {
+    Node *node=pointer(head[0].load(std::memory_order_acquire));
+    while(node!=nullptr)
+    {
+        Node *next=pointer(node->next()[0].load(std::memory_order_relaxed));
+        destroy(node);
+        node=next;
+    }
+  }
+
+  // returns true if the key was new
+  bool insert_or_assign(const key_type& key, const mapped_type& value)
+  {
+    return put(new value_type(key,value),true);
+  }
+
+  bool insert_or_assign(const key_type& key, mapped_type&& value)
+  {
+    return put(new value_type(key,std::move(value)),true);
+  }
+
+  // inserts only if the key is absent, returns true if it did
+  bool insert(const key_type& key, const mapped_type& value)
+  {
+    return put(new value_type(key,value),false);
+  }
+
+  // calls visit(const mapped_type&) on the value current at the time of the lookup, returns false on a miss
+  template <typename Visitor>
+  bool find(const key_type& key, Visitor visit) const
+  {
+    Epoch::Guard guard;
+    Node *node=search(key);
+    if(node==nullptr) return false;
+    visit(node->entry.load(std::memory_order_acquire)->second);
+    return true;
+  }
+
+  // calls update(mapped_type&) on a copy of the value and publishes it if no other write came
+  // in between; otherwise it starts over from the newer value, so update may run more than once
+  template <typename Updater>
+  bool update(const key_type& key, Updater update)
+  {
+    Epoch::Guard guard;
+    Node *node=search(key);
+    if(node==nullptr) return false;
+    const value_type *current=node->entry.load(std::memory_order_acquire);
+    for(;;)
+    {
+        value_type *changed=new value_type(*current);
+        update(changed->second);
+        if(node->entry.compare_exchange_strong(current,changed,std::memory_order_acq_rel))
+        {
+            Epoch::retire(const_cast<value_type*>(current));
+            return true;
+        }
+        delete changed;
+    }
+  }
+
+  bool contains(const key_type& key) const
+  {
+    Epoch::Guard guard;
+    return search(key)!=nullptr;
+  }
+
+  // a copy, since the stored value may be replaced as soon as the lookup ends
+  mapped_type valueOf(const key_type& key) const
+  {
+    Epoch::Guard guard;
+    Node *node=search(key);
+    if(node==nullptr)
+        throw std::out_of_range("valueOf");
+    return node->entry.load(std::memory_order_acquire)->second;
+  }
+
+  // returns false if the key was not there
+  bool erase(const key_type& key)
+  {
+    Epoch::Guard guard;
+    Node *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+    if(!locate(key,preds,succs)) return false;
+    Node *node=succs[0];
+    for(int level=node->height-1;level>0;--level)
+    {
+        std::uintptr_t next=node->next()[level].load(std::memory_order_acquire);
+        while(!marked(next) && !node->next()[level].compare_exchange_weak(next,next|MARK,std::memory_order_acq_rel))
+        {}
+    }
+    std::uintptr_t next=node->next()[0].load(std::memory_order_acquire);
+    for(;;)
+    {
+        if(marked(next)) return false; //another erase got there first
+        if(node->next()[0].compare_exchange_weak(next,next|MARK,std::memory_order_acq_rel)) break;
+    }
+    count.fetch_sub(1,std::memory_order_relaxed);
+    locate(key,preds,succs);
+    release(node);
+    return true;
+  }
+
+  // calls visit(const value_type&) for keys in [from, to) in order; sees every key present
+  // for the whole call, keys inserted or erased meanwhile may or may not be visited
+  template <typename Visitor>
+  void forEachInRange(const key_type& from, const key_type& to, Visitor visit) const
+  {
+    Epoch::Guard guard;
+    for(Node *node=lower_bound_node(from);node!=nullptr && Less(node->key,to);node=successor(node))
+        visit(*node->entry.load(std::memory_order_acquire));
+  }
+
+  template <typename Visitor>
+  void forEach(Visitor visit) const
+  {
+    Epoch::Guard guard;
+    for(Node *node=first_node();node!=nullptr;node=successor(node))
+        visit(*node->entry.load(std::memory_order_acquire));
+  }
+
+  // exact only while no writer is running
+  size_type getSize() const
+  {
+    return count.load(std::memory_order_relaxed);
+  }
+
+  key_compare key_comp() const
+  {
+    return StoredCompare::get();
+  }
+
+  bool isEmpty() const
+  {
+    return getSize()==0;
+  }
+
+  // iterators hold an Epoch::Guard, so they belong to the thread that made them
+  // and keep what they point at, even if it gets erased, alive while they exist
+  const_iterator find(const key_type& key) const
+  {
+    Epoch::Guard guard;
+    return ConstIterator(search(key));
+  }
+
+  // first element whose key is not less than key
+  const_iterator lower_bound(const key_type& key) const
+  {
+    Epoch::Guard guard;
+    return ConstIterator(lower_bound_node(key));
+  }
+
+  // first element whose key is greater than key
+  const_iterator upper_bound(const key_type& key) const
+  {
+    Epoch::Guard guard;
+    Node *node=lower_bound_node(key);
+    if(node!=nullptr && !Less(key,node->key)) node=successor(node);
+    return ConstIterator(node);
+  }
+
+  const_iterator cbegin() const
+  {
+    Epoch::Guard guard;
+    return ConstIterator(first_node());
+  }
+
+  const_iterator cend() const
+  {
+    return ConstIterator(nullptr);
+  }
+
+  const_iterator begin() const
+  {
+    return cbegin();
+  }
+
+  const_iterator end() const
+  {
+    return cend();
+  }
+
+private:
+
+  bool Less(const key_type& a, const key_type& b) const
+  {
+    return StoredCompare::get()(a,b);
+  }
+
+  static bool marked(std::uintptr_t link)
+  {
+    return (link & MARK)!=0;
+  }
+
+  static Node* pointer(std::uintptr_t link)
+  {
+    return reinterpret_cast<Node*>(link & ~MARK);
+  }
+
+  static std::uintptr_t address(Node *node)
+  {
+    return reinterpret_cast<std::uintptr_t>(node);
+  }
+
+  // next pointer at level of pred, the head's for nullptr
+  std::atomic<std::uintptr_t>& link(Node *pred, int level) const
+  {
+    return pred==nullptr ? const_cast<std::atomic<std::uintptr_t>&>(head[level]) : pred->next()[level];
+  }
+
+  // geometric with p=1/4: two zero bits per extra level
+  static int random_height()
+  {
+    static thread_local std::uint64_t state=0x9E3779B97F4A7C15ULL ^ reinterpret_cast<std::uintptr_t>(&state);
+    state^=state>>12;
+    state^=state<<25;
+    state^=state>>27;
+    std::uint64_t bits=state*0x2545F4914F6CDD1DULL;
+    return __builtin_ctzll(bits | (std::uint64_t(1)<<(2*(MAX_LEVEL-1))))/2+1;
+  }
+
+  static Node* create(const value_type *entry, int height)
+  {
+    void *raw=::operator new(sizeof(Node)+height*sizeof(std::atomic<std::uintptr_t>));
+    Node *node=new(raw) Node(entry->first,entry,height);
+    for(int i=0;i<height;++i)
+        new(&node->next()[i]) std::atomic<std::uintptr_t>(0);
+    return node;
+  }
+
+  // the node's entry too, unless it was taken out before
+  static void destroy(Node *node)
+  {
+    delete node->entry.load(std::memory_order_relaxed);
+    node->~Node();
+    ::operator delete(node);
+  }
+
+  static void destroy_retired(void *node)
+  {
+    destroy(static_cast<Node*>(node));
+  }
+
+  // inserts entry or, if assign, swaps it for the pair of a present key; entry is consumed either way
+  bool put(const value_type *entry, bool assign)
+  {
+    Epoch::Guard guard;
+    Node *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+    Node *node=nullptr;
+    for(;;)
+    {
+        if(locate(entry->first,preds,succs))
+        {
+            if(node!=nullptr)
+            {
+                node->entry.store(nullptr,std::memory_order_relaxed);
+                destroy(node);
+            }
+            if(!assign)
+            {
+                delete entry;
+                return false;
+            }
+            const value_type *old=succs[0]->entry.exchange(entry,std::memory_order_acq_rel);
+            Epoch::retire(const_cast<value_type*>(old));
+            return false;
+        }
+        if(node==nullptr)
+            node=create(entry,random_height());
+        for(int level=0;level<node->height;++level)
+            node->next()[level].store(address(succs[level]),std::memory_order_relaxed);
+        std::uintptr_t expected=address(succs[0]);
+        if(link(preds[0],0).compare_exchange_strong(expected,address(node),std::memory_order_release,std::memory_order_relaxed))
+            break;
+    }
+    count.fetch_add(1,std::memory_order_relaxed);
+    link_upper_levels(node,preds,succs);
+    release(node);
+    return true;
+  }
+
+  // links a node already on the bottom level into the levels above; stops early if it gets erased
+  void link_upper_levels(Node *node, Node **preds, Node **succs)
+  {
+    for(int level=1;level<node->height;++level)
+    {
+        for(;;)
+        {
+            std::uintptr_t next=node->next()[level].load(std::memory_order_acquire);
+            if(marked(next)) return;
+            if(next!=address(succs[level])
+               && !node->next()[level].compare_exchange_strong(next,address(succs[level]),std::memory_order_acq_rel))
+                continue;
+            std::uintptr_t expected=address(succs[level]);
+            if(link(preds[level],level).compare_exchange_strong(expected,address(node),std::memory_order_release,std::memory_order_relaxed))
+                break;
+            if(!locate(node->key,preds,succs) || succs[0]!=node) return;
+        }
+    }
+  }
+
+  // once both the insert and the erase are done with the node, it is unlinked from every
+  // level it made it to, and nobody can link it again
+  void release(Node *node)
+  {
+    if(node->owners.fetch_sub(1,std::memory_order_acq_rel)!=1) return;
+    Node *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+    locate(node->key,preds,succs);
+    Epoch::retire(node,&ConcurrentTreeMap::destroy_retired);
+  }
+
+  // the last node before key and the first one not before it on every level, unlinking marked
+  // nodes on the way; starts over when an unlink fails; true if succs[0] holds key
+  bool locate(const key_type& key, Node **preds, Node **succs)
+  {
+    for(;;)
+    {
+        bool restart=false;
+        Node *pred=nullptr;
+        for(int level=MAX_LEVEL-1;level>=0 && !restart;--level)
+        {
+            Node *curr=pointer(link(pred,level).load(std::memory_order_acquire));
+            while(curr!=nullptr)
+            {
+                std::uintptr_t next=curr->next()[level].load(std::memory_order_acquire);
+                if(marked(next))
+                {
+                    std::uintptr_t expected=address(curr);
+                    if(!link(pred,level).compare_exchange_strong(expected,next & ~MARK,std::memory_order_acq_rel))
+                    {
+                        restart=true;
+                        break;
+                    }
+                    curr=pointer(next);
+                    continue;
+                }
+                if(!Less(curr->key,key)) break;
+                pred=curr;
+                curr=pointer(next);
+            }
+            preds[level]=pred;
+            succs[level]=curr;
+        }
+        if(!restart)
+            return succs[0]!=nullptr && !Less(key,succs[0]->key);
+    }
+  }
+
+  // first node whose key is not less than key, stepping over marked nodes without unlinking them;
+  // the level below continues from pred, so its next node is fetched while this level goes on
+  Node* lower_bound_node(const key_type& key) const
+  {
+    Node *pred=nullptr;
+    Node *curr=nullptr;
+    for(int level=MAX_LEVEL-1;level>=0;--level)
+    {
+        curr=pointer(link(pred,level).load(std::memory_order_acquire));
+        while(curr!=nullptr)
+        {
+            std::uintptr_t next=curr->next()[level].load(std::memory_order_acquire);
+            if(!marked(next))
+            {
+                if(!Less(curr->key,key)) break;
+                pred=curr;
+                if(level>0)
+                    __builtin_prefetch(pointer(curr->next()[level-1].load(std::memory_order_relaxed)));
+            }
+            curr=pointer(next);
+        }
+    }
+    return curr;
+  }
+
+  Node* search(const key_type& key) const
+  {
+    Node *node=lower_bound_node(key);
+    return node!=nullptr && !Less(key,node->key) ? node : nullptr;
+  }
+
+  static Node* first_live(Node *node)
+  {
+    while(node!=nullptr && marked(node->next()[0].load(std::memory_order_acquire)))
+        node=pointer(node->next()[0].load(std::memory_order_acquire));
+    return node;
+  }
+
+  Node* first_node() const
+  {
+    return first_live(pointer(head[0].load(std::memory_order_acquire)));
+  }
+
+  static Node* successor(Node *node)
+  {
+    return first_live(pointer(node->next()[0].load(std::memory_order_acquire)));
+  }
+};
+
+// forward iterator over the bottom level
+template <typename KeyType, typename ValueType, typename Compare>
+class ConcurrentTreeMap<KeyType, ValueType, Compare>::ConstIterator
+{
+public:
+  using reference = typename ConcurrentTreeMap::const_reference;
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = typename ConcurrentTreeMap::value_type;
+  using pointer = const typename ConcurrentTreeMap::value_type*;
+  using difference_type = std::ptrdiff_t;
+
+  explicit ConstIterator(Node *n=nullptr) : node(n), entry(n!=nullptr ? n->entry.load(std::memory_order_acquire) : nullptr)
+  {}
+
+  ConstIterator& operator++()
+  {
+    if(node==nullptr)
+        throw std::out_of_range("++");
+    node=ConcurrentTreeMap::successor(node);
+    entry= node!=nullptr ? node->entry.load(std::memory_order_acquire) : nullptr;
+    return *this;
+  }
+
+  ConstIterator operator++(int)
+  {
+    ConstIterator temp=*this;
+    operator++();
+    return temp;
+  }
+
+  // the pair as it was when the iterator got to it
+  reference operator*() const
+  {
+    if(node==nullptr)
+        throw std::out_of_range("*");
+    return *entry;
+  }
+
+  pointer operator->() const
+  {
+    return &this->operator*();
+  }
+
+  bool operator==(const ConstIterator& other) const
+  {
+    return node==other.node;
+  }
+
+  bool operator!=(const ConstIterator& other) const
+  {
+    return !(*this == other);
+  }
+
+private:
+  Epoch::Guard guard;
+  Node *node;
+  const value_type *entry;
+};
+
+}
+
+#endif /* AISDI_MAPS_CONCURRENTTREEMAP_H */
@@ -0,0 +1,286 @@
+#ifndef AISDI_MAPS_EPOCH_H
+#define AISDI_MAPS_EPOCH_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace aisdi
+{
+
+// Epoch based reclamation for the lock-free maps. A thread reading shared nodes holds an
+// Epoch::Guard; a node unlinked from a structure is handed to retire() and freed only once
+// the global epoch has advanced twice, which needs every thread inside a guard to have
+// entered after the unlink, so none of them can still hold a pointer to it.
+// Every thread owns a record on a global list; the record outlives the thread and is reused by
+// the next thread that starts. A thread that exits frees what is safe to free already and leaves
+// the rest as orphans, which any thread's collect() frees in time. Whatever is still waiting
+// when the program ends is freed then; by that time no thread may use Epoch any more, and a
+// retire() after it frees at once.
+class Epoch
+{
+  static const std::uint64_t IDLE=~std::uint64_t(0);
+  static const unsigned COLLECT_EVERY=64; //retires between attempts to advance the epoch
+
+  struct Retired
+  {
+    void *object;
+    void (*destroy)(void*);
+  };
+
+  struct alignas(64) Record
+  {
+    std::atomic<std::uint64_t> epoch{IDLE}; //global epoch seen on entry, IDLE outside any guard
+    std::atomic<bool> in_use{true};
+    Record *next=nullptr; //set once before the record is published
+    unsigned nesting=0;
+    unsigned retired_since_collect=0;
+    std::vector<Retired> limbo[3]; //retired objects by epoch modulo 3
+    std::uint64_t limbo_epoch[3]={0,0,0};
+  };
+
+  // acquires a record on construction and gives it back, limbo drained, when the thread exits
+  struct Local
+  {
+    Record *record;
+
+    Local() : record(acquire()) {}
+
+    ~Local()
+    {
+      drain(record);
+      record->in_use.store(false,std::memory_order_release);
+    }
+  };
+
+  // a limbo list left behind by a thread that exited
+  struct Orphan
+  {
+    std::vector<Retired> objects;
+    std::uint64_t epoch; //when they were retired
+  };
+
+  // holds the orphans; destroyed at program exit, it frees them and every record with whatever
+  // the record still holds
+  struct Domain
+  {
+    std::mutex lock;
+    std::vector<Orphan> orphans;
+
+    ~Domain()
+    {
+      shut_down.store(true,std::memory_order_release);
+      for(const Orphan& orphan : orphans)
+          free_all(orphan.objects);
+      Record *record=records.exchange(nullptr,std::memory_order_acquire);
+      while(record!=nullptr)
+      {
+          Record *next=record->next;
+          for(size_t slot=0;slot<3;++slot)
+              free_limbo(record,slot);
+          delete record;
+          record=next;
+      }
+    }
+  };
+
+  inline static std::atomic<std::uint64_t> global_epoch{0};
+  inline static std::atomic<Record*> records{nullptr};
+  inline static std::atomic<bool> has_orphans{false}; //so collect() only locks when there is something to look at
+  inline static std::atomic<bool> shut_down{false}; //set by ~Domain(); then retire() frees at once and guards do nothing
+  inline static Domain domain;
+
+public:
+  // pins the current epoch for the calling thread; guards nest and must stay on their thread
+  class Guard
+  {
+  public:
+    Guard()
+    {
+      Epoch::enter();
+    }
+
+    Guard(const Guard&)
+    {
+      Epoch::enter();
+    }
+
+    Guard& operator=(const Guard&)
+    {
+      return *this;
+    }
+
+    ~Guard()
+    {
+      Epoch::leave();
+    }
+  };
+
+  // frees object with destroy(object) once no guard that might see it is left
+  static void retire(void *object, void (*destroy)(void*))
+  {
+    if(shut_down.load(std::memory_order_acquire))
+    {
+        destroy(object);
+        return;
+    }
+    Record *record=local();
+    std::uint64_t epoch=global_epoch.load(std::memory_order_acquire);
+    size_t slot=epoch%3;
+    if(record->limbo_epoch[slot]!=epoch)
+    {
+        free_limbo(record,slot);
+        record->limbo_epoch[slot]=epoch;
+    }
+    record->limbo[slot].push_back(Retired{object,destroy});
+    if(++record->retired_since_collect>=COLLECT_EVERY)
+        collect();
+  }
+
+  template <typename T>
+  static void retire(T *object)
+  {
+    retire(object,[](void *p) { delete static_cast<T*>(p); });
+  }
+
+  // tries to advance the epoch and frees what this thread, or one that exited, retired two epochs back
+  static void collect()
+  {
+    if(shut_down.load(std::memory_order_acquire)) return;
+    collect(local());
+  }
+
+private:
+
+  static void collect(Record *record)
+  {
+    record->retired_since_collect=0;
+    try_advance();
+    std::uint64_t epoch=global_epoch.load(std::memory_order_acquire);
+    for(size_t slot=0;slot<3;++slot)
+        if(record->limbo_epoch[slot]+2<=epoch)
+            free_limbo(record,slot);
+    if(has_orphans.load(std::memory_order_relaxed))
+        free_orphans(epoch);
+  }
+
+  // the thread of record exits: what it retired in the last two epochs becomes orphans
+  static void drain(Record *record)
+  {
+    if(shut_down.load(std::memory_order_acquire)) return;
+    collect(record);
+    std::vector<Orphan> left;
+    for(size_t slot=0;slot<3;++slot)
+        if(!record->limbo[slot].empty())
+        {
+            left.push_back(Orphan{std::vector<Retired>(),record->limbo_epoch[slot]});
+            left.back().objects.swap(record->limbo[slot]);
+        }
+    if(left.empty()) return;
+    std::lock_guard<std::mutex> guard(domain.lock);
+    for(Orphan& orphan : left)
+        domain.orphans.push_back(std::move(orphan));
+    has_orphans.store(true,std::memory_order_relaxed);
+  }
+
+  // orphans are taken out under the lock and freed after it, destroy being free to retire more
+  static void free_orphans(std::uint64_t epoch)
+  {
+    std::vector<Orphan> ripe;
+    {
+        std::lock_guard<std::mutex> guard(domain.lock);
+        for(size_t i=0;i<domain.orphans.size();)
+        {
+            if(domain.orphans[i].epoch+2>epoch)
+            {
+                ++i;
+                continue;
+            }
+            ripe.push_back(std::move(domain.orphans[i]));
+            if(i+1<domain.orphans.size())
+                domain.orphans[i]=std::move(domain.orphans.back());
+            domain.orphans.pop_back();
+        }
+        has_orphans.store(!domain.orphans.empty(),std::memory_order_relaxed);
+    }
+    for(const Orphan& orphan : ripe)
+        free_all(orphan.objects);
+  }
+
+  static void enter()
+  {
+    if(shut_down.load(std::memory_order_acquire)) return;
+    Record *record=local();
+    if(record->nesting++!=0) return;
+    std::uint64_t epoch=global_epoch.load(std::memory_order_relaxed);
+    for(;;)
+    {
+        record->epoch.store(epoch,std::memory_order_seq_cst);
+        std::uint64_t now=global_epoch.load(std::memory_order_seq_cst);
+        if(now==epoch) break;
+        epoch=now;
+    }
+  }
+
+  static void leave()
+  {
+    if(shut_down.load(std::memory_order_acquire)) return;
+    Record *record=local();
+    if(--record->nesting==0)
+        record->epoch.store(IDLE,std::memory_order_release);
+  }
+
+  // the epoch moves on only when every thread inside a guard has already seen it
+  static void try_advance()
+  {
+    std::uint64_t epoch=global_epoch.load(std::memory_order_seq_cst);
+    for(Record *r=records.load(std::memory_order_acquire);r!=nullptr;r=r->next)
+    {
+        std::uint64_t seen=r->epoch.load(std::memory_order_seq_cst);
+        if(seen!=IDLE && seen!=epoch) return;
+    }
+    global_epoch.compare_exchange_strong(epoch,epoch+1,std::memory_order_seq_cst);
+  }
+
+  static void free_limbo(Record *record, size_t slot)
+  {
+    std::vector<Retired> pending;
+    pending.swap(record->limbo[slot]);
+    free_all(pending);
+  }
+
+  static void free_all(const std::vector<Retired>& objects)
+  {
+    for(const Retired& r : objects)
+        r.destroy(r.object);
+  }
+
+  static Record* local()
+  {
+    static thread_local Local local;
+    return local.record;
+  }
+
+  static Record* acquire()
+  {
+    for(Record *r=records.load(std::memory_order_acquire);r!=nullptr;r=r->next)
+    {
+        bool free=false;
+        if(!r->in_use.load(std::memory_order_relaxed)
+           && r->in_use.compare_exchange_strong(free,true,std::memory_order_acquire))
+            return r;
+    }
+    Record *record=new Record;
+    Record *head=records.load(std::memory_order_relaxed);
+    do
+        record->next=head;
+    while(!records.compare_exchange_weak(head,record,std::memory_order_release,std::memory_order_relaxed));
+    return record;
+  }
+};
+
+}
+
+#endif /* AISDI_MAPS_EPOCH_H */
@@ -0,0 +1,620 @@
+#ifndef AISDI_MAPS_FLATHASHMAP_H
+#define AISDI_MAPS_FLATHASHMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "Hashing.h"
+
+namespace aisdi
+{
+
+// Open addressing hash map: one control byte per slot (empty, deleted or 7 bits of the hash)
+// and slots probed a whole group at a time, so most lookups touch a single cache line of control bytes.
+template <typename KeyType, typename ValueType>
+class FlatHashMap
+{
+public:
+  using key_type = KeyType;
+  using mapped_type = ValueType;
+  using value_type = std::pair<const key_type, mapped_type>;
+  using size_type = std::size_t;
+  using reference = value_type&;
+  using const_reference = const value_type&;
+
+  class ConstIterator;
+  class Iterator;
+  using iterator = Iterator;
+  using const_iterator = ConstIterator;
+
+private:
+  using ctrl_t = std::int8_t;
+
+  static const ctrl_t EMPTY = -128;  // 0b10000000
+  static const ctrl_t DELETED = -2;  // 0b11111110, tombstone
+  static const ctrl_t SENTINEL = -1; // everything below is empty or deleted
+
+#if defined(__AVX2__)
+  static const size_t GROUP_WIDTH = 32;
+#else
+  static const size_t GROUP_WIDTH = 16;
+#endif
+
+  // bitmask of the slots in one group matching a condition, bit i for slot i
+  struct Group
+  {
+#if defined(__AVX2__)
+    __m256i ctrl;
+
+    explicit Group(const ctrl_t *pos) : ctrl(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos))) {}
+
+    std::uint32_t match(ctrl_t h2) const
+    {
+      return std::uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_set1_epi8(h2), ctrl)));
+    }
+
+    std::uint32_t matchEmptyOrDeleted() const
+    {
+      return std::uint32_t(_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(SENTINEL), ctrl)));
+    }
+
+    std::uint32_t matchFull() const
+    {
+      return ~std::uint32_t(_mm256_movemask_epi8(ctrl));
+    }
+#elif defined(__SSE2__)
+    __m128i ctrl;
+
+    explicit Group(const ctrl_t *pos) : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos))) {}
+
+    std::uint32_t match(ctrl_t h2) const
+    {
+      return std::uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl)));
+    }
+
+    std::uint32_t matchEmptyOrDeleted() const
+    {
+      return std::uint32_t(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(SENTINEL), ctrl)));
+    }
+
+    std::uint32_t matchFull() const
+    {
+      return std::uint32_t(_mm_movemask_epi8(ctrl)) ^ 0xFFFFu;
+    }
+#else
+    const ctrl_t *ctrl;
+
+    explicit Group(const ctrl_t *pos) : ctrl(pos) {}
+
+    std::uint32_t match(ctrl_t h2) const
+    {
+      std::uint32_t mask=0;
+      for(size_t i=0;i<GROUP_WIDTH;++i)
+        if(ctrl[i]==h2) mask|=1u<<i;
+      return mask;
+    }
+
+    std::uint32_t matchEmptyOrDeleted() const
+    {
+      std::uint32_t mask=0;
+      for(size_t i=0;i<GROUP_WIDTH;++i)
+        if(ctrl[i]<SENTINEL) mask|=1u<<i;
+      return mask;
+    }
+
+    std::uint32_t matchFull() const
+    {
+      std::uint32_t mask=0;
+      for(size_t i=0;i<GROUP_WIDTH;++i)
+        if(ctrl[i]>=0) mask|=1u<<i;
+      return mask;
+    }
+#endif
+
+    std::uint32_t matchEmpty() const
+    {
+      return match(EMPTY);
+    }
+  };
+
+  ctrl_t *ctrl;
+  value_type *slots;
+  size_t capacity; // 0 or a power of two multiple of GROUP_WIDTH
+  size_t Size;
+  size_t deleted;
+
+public:
+  FlatHashMap() : ctrl(nullptr), slots(nullptr), capacity(0), Size(0), deleted(0) {}
+
+  FlatHashMap(std::initializer_list<value_type> list) : FlatHashMap()
+  {
+    reserve(list.size());
+    for(auto it=list.begin();it!=list.end();++it)
+      this->operator[](it->first)=it->second;
+  }
+
+  FlatHashMap(const FlatHashMap& other) : FlatHashMap()
+  {
+    copy_from(other);
+  }
+
+  FlatHashMap(FlatHashMap&& other) noexcept : FlatHashMap()
+  {
+    swap(other);
+  }
+
+  ~FlatHashMap()
+  {
+    destroy();
+  }
+
+  // leaves this map as it was if copying an element throws
+  FlatHashMap& operator=(const FlatHashMap& other)
+  {
+    if(this==&other) return *this;
+    FlatHashMap copy(other);
+    swap(copy);
+    return *this;
+  }
+
+  FlatHashMap& operator=(FlatHashMap&& other) noexcept
+  {
+    if(this==&other) return *this;
+    destroy();
+    swap(other);
+    return *this;
+  }
+
+  bool isEmpty() const
+  {
+    return !Size;
+  }
+
+  mapped_type& operator[](const key_type& key)
+  {
+    size_t hash=Hash(key);
+    size_t index=find_index(key,hash);
+    if(index!=capacity) return slots[index].second;
+
+    if(Size+deleted+1>max_load(capacity))
+    {
+      resize(Size+1>max_load(capacity)/2 ? grown_capacity() : capacity);
+    }
+    index=find_insert_slot(hash);
+    new (slots+index) value_type(key,mapped_type{});
+    if(ctrl[index]==DELETED) --deleted; //only once the element exists, in case building it threw
+    ctrl[index]=H2(hash);
+    ++Size;
+    return slots[index].second;
+  }
+
+  const mapped_type& valueOf(const key_type& key) const
+  {
+    size_t index=find_index(key,Hash(key));
+    if(index==capacity)
+      throw std::out_of_range("valueOf");
+    return slots[index].second;
+  }
+
+  mapped_type& valueOf(const key_type& key)
+  {
+    size_t index=find_index(key,Hash(key));
+    if(index==capacity)
+      throw std::out_of_range("valueOf");
+    return slots[index].second;
+  }
+
+  const_iterator find(const key_type& key) const
+  {
+    return ConstIterator(this,find_index(key,Hash(key)));
+  }
+
+  iterator find(const key_type& key)
+  {
+    return Iterator(this,find_index(key,Hash(key)));
+  }
+
+  void remove(const key_type& key)
+  {
+    size_t index=find_index(key,Hash(key));
+    if(index==capacity)
+      throw std::out_of_range("remove");
+    erase_slot(index);
+  }
+
+  void remove(const const_iterator& it)
+  {
+    if(it.map!=this || it.index>=capacity || ctrl[it.index]<0)
+      throw std::out_of_range("remove");
+    erase_slot(it.index);
+  }
+
+  size_type getSize() const
+  {
+    return Size;
+  }
+
+  // makes room for n elements without further rehashing
+  void reserve(size_type n)
+  {
+    if(n==0) return;
+    size_t new_capacity=capacity ? capacity : GROUP_WIDTH;
+    while(max_load(new_capacity)<n) new_capacity*=2;
+    if(new_capacity>capacity) resize(new_capacity);
+  }
+
+  size_type bucket_count() const
+  {
+    return capacity;
+  }
+
+  bool operator==(const FlatHashMap& other) const
+  {
+    if(Size!=other.Size)
+      return false;
+    for(auto it=other.begin();it!=other.end();++it)
+    {
+      size_t index=find_index(it->first,Hash(it->first));
+      if(index==capacity || slots[index].second!=it->second) return false;
+    }
+    return true;
+  }
+
+  bool operator!=(const FlatHashMap& other) const
+  {
+    return !(*this == other);
+  }
+
+  iterator begin()
+  {
+    return Iterator(this,next_full(0));
+  }
+
+  iterator end()
+  {
+    return Iterator(this,capacity);
+  }
+
+  const_iterator cbegin() const
+  {
+    return ConstIterator(this,next_full(0));
+  }
+
+  const_iterator cend() const
+  {
+    return ConstIterator(this,capacity);
+  }
+
+  const_iterator begin() const
+  {
+    return cbegin();
+  }
+
+  const_iterator end() const
+  {
+    return cend();
+  }
+
+private:
+
+  // as in HashMap: DefaultHash, passed through mix64 unless it avalanches, since H1 and H2 both need mixed bits
+  static size_t Hash(const key_type& key)
+  {
+    using hasher = DefaultHash<key_type>;
+    if constexpr(is_avalanching<hasher>::value)
+      return hasher()(key);
+    else
+      return size_t(mix64(hasher()(key)));
+  }
+
+  static size_t H1(size_t hash)
+  {
+    return hash>>7;
+  }
+
+  static ctrl_t H2(size_t hash)
+  {
+    return ctrl_t(hash & 0x7F);
+  }
+
+  static size_t max_load(size_t cap)
+  {
+    return cap-cap/8;
+  }
+
+  static size_t lowest_bit(std::uint32_t mask)
+  {
+    return size_t(__builtin_ctz(mask));
+  }
+
+  static size_t highest_bit(std::uint32_t mask)
+  {
+    return 31-size_t(__builtin_clz(mask));
+  }
+
+  size_t grown_capacity() const
+  {
+    return capacity ? capacity*2 : GROUP_WIDTH;
+  }
+
+  // groups are probed in triangular order, which visits every group of a power of two table
+  size_t find_index(const key_type& key, size_t hash) const
+  {
+    if(Size==0) return capacity;
+    size_t group_mask=capacity/GROUP_WIDTH-1;
+    size_t g=H1(hash) & group_mask;
+    ctrl_t h2=H2(hash);
+    for(size_t i=1;;++i)
+    {
+      Group group(ctrl+g*GROUP_WIDTH);
+      for(std::uint32_t match=group.match(h2);match;match&=match-1)
+      {
+        size_t index=g*GROUP_WIDTH+lowest_bit(match);
+        if(slots[index].first==key) return index;
+      }
+      if(group.matchEmpty()) return capacity;
+      g=(g+i) & group_mask;
+    }
+  }
+
+  size_t find_insert_slot(size_t hash) const
+  {
+    size_t group_mask=capacity/GROUP_WIDTH-1;
+    size_t g=H1(hash) & group_mask;
+    for(size_t i=1;;++i)
+    {
+      std::uint32_t available=Group(ctrl+g*GROUP_WIDTH).matchEmptyOrDeleted();
+      if(available) return g*GROUP_WIDTH+lowest_bit(available);
+      g=(g+i) & group_mask;
+    }
+  }
+
+  // a slot may become empty again only if no probe could have walked past its group,
+  // i.e. the group still has an empty slot; otherwise it has to stay a tombstone
+  void erase_slot(size_t index)
+  {
+    slots[index].~value_type();
+    size_t group_start=index-index%GROUP_WIDTH;
+    if(Group(ctrl+group_start).matchEmpty())
+      ctrl[index]=EMPTY;
+    else
+    {
+      ctrl[index]=DELETED;
+      ++deleted;
+    }
+    --Size;
+  }
+
+  void resize(size_t new_capacity)
+  {
+    ctrl_t *old_ctrl=ctrl;
+    value_type *old_slots=slots;
+    size_t old_capacity=capacity;
+
+    allocate(new_capacity);
+    for(size_t i=0;i<old_capacity;++i)
+    {
+      if(old_ctrl[i]<0) continue;
+      size_t hash=Hash(old_slots[i].first);
+      size_t index=find_insert_slot(hash);
+      new (slots+index) value_type(std::move(old_slots[i]));
+      ctrl[index]=H2(hash);
+      old_slots[i].~value_type();
+    }
+    delete[] old_ctrl;
+    ::operator delete(old_slots);
+  }
+
+  void allocate(size_t new_capacity)
+  {
+    ctrl=new ctrl_t[new_capacity];
+    std::memset(ctrl,EMPTY,new_capacity);
+    slots=static_cast<value_type*>(::operator new(new_capacity*sizeof(value_type)));
+    capacity=new_capacity;
+    deleted=0;
+  }
+
+  // a slot's control byte is copied only once its element is built, so if a copy throws,
+  // destroy() sees exactly the elements that exist
+  void copy_from(const FlatHashMap& other)
+  {
+    if(other.capacity==0) return;
+    allocate(other.capacity);
+    for(size_t i=0;i<capacity;++i)
+    {
+      if(other.ctrl[i]>=0)
+      {
+        new (slots+i) value_type(other.slots[i]);
+        ++Size;
+      }
+      ctrl[i]=other.ctrl[i];
+    }
+    deleted=other.deleted;
+  }
+
+  void destroy()
+  {
+    for(size_t i=0;i<capacity;++i)
+      if(ctrl[i]>=0) slots[i].~value_type();
+    delete[] ctrl;
+    ::operator delete(slots);
+    ctrl=nullptr;
+    slots=nullptr;
+    capacity=Size=deleted=0;
+  }
+
+  void swap(FlatHashMap& other)
+  {
+    std::swap(ctrl,other.ctrl);
+    std::swap(slots,other.slots);
+    std::swap(capacity,other.capacity);
+    std::swap(Size,other.Size);
+    std::swap(deleted,other.deleted);
+  }
+
+  size_t next_full(size_t index) const
+  {
+    while(index<capacity)
+    {
+      size_t group_start=index-index%GROUP_WIDTH;
+      std::uint32_t full=Group(ctrl+group_start).matchFull();
+      full&=~std::uint32_t(0) << (index-group_start);
+      if(full) return group_start+lowest_bit(full);
+      index=group_start+GROUP_WIDTH;
+    }
+    return capacity;
+  }
+
+  // last full slot before index, or capacity when there is none
+  size_t prev_full(size_t index) const
+  {
+    while(index>0)
+    {
+      size_t group_start=(index-1)-(index-1)%GROUP_WIDTH;
+      std::uint32_t full=Group(ctrl+group_start).matchFull();
+      size_t width=index-group_start;
+      if(width<32) full&=(std::uint32_t(1) << width)-1;
+      if(full) return group_start+highest_bit(full);
+      index=group_start;
+    }
+    return capacity;
+  }
+};
+
+template <typename KeyType, typename ValueType>
+class FlatHashMap<KeyType, ValueType>::ConstIterator
+{
+public:
+  using reference = typename FlatHashMap::const_reference;
+  using iterator_category = std::bidirectional_iterator_tag;
+  using value_type = typename FlatHashMap::value_type;
+  using pointer = const typename FlatHashMap::value_type*;
+
+private:
+  const FlatHashMap *map;
+  size_t index;
+
+  friend class FlatHashMap<KeyType, ValueType>;
+
+public:
+  explicit ConstIterator(const FlatHashMap *m=nullptr, size_t i=0) : map(m), index(i) {}
+
+  ConstIterator(const ConstIterator& other) : ConstIterator(other.map,other.index) {}
+
+  ConstIterator& operator++()
+  {
+    if(map==nullptr || index>=map->capacity)
+      throw std::out_of_range("++");
+    index=map->next_full(index+1);
+    return *this;
+  }
+
+  ConstIterator operator++(int)
+  {
+    ConstIterator temp=*this;
+    operator++();
+    return temp;
+  }
+
+  ConstIterator& operator--()
+  {
+    size_t prev=map ? map->prev_full(index) : 0;
+    if(map==nullptr || prev==map->capacity)
+      throw std::out_of_range("--");
+    index=prev;
+    return *this;
+  }
+
+  ConstIterator operator--(int)
+  {
+    ConstIterator temp=*this;
+    operator--();
+    return temp;
+  }
+
+  reference operator*() const
+  {
+    if(map==nullptr || index>=map->capacity)
+      throw std::out_of_range("*");
+    return map->slots[index];
+  }
+
+  pointer operator->() const
+  {
+    return &this->operator*();
+  }
+
+  bool operator==(const ConstIterator& other) const
+  {
+    return map==other.map && index==other.index;
+  }
+
+  bool operator!=(const ConstIterator& other) const
+  {
+    return !(*this == other);
+  }
+};
+
+template <typename KeyType, typename ValueType>
+class FlatHashMap<KeyType, ValueType>::Iterator : public FlatHashMap<KeyType, ValueType>::ConstIterator
+{
+public:
+  using reference = typename FlatHashMap::reference;
+  using pointer = typename FlatHashMap::value_type*;
+
+  explicit Iterator(const FlatHashMap *m=nullptr, size_t i=0) : ConstIterator(m,i) {}
+
+  Iterator(const ConstIterator& other)
+    : ConstIterator(other)
+  {}
+
+  Iterator& operator++()
+  {
+    ConstIterator::operator++();
+    return *this;
+  }
+
+  Iterator operator++(int)
+  {
+    auto result = *this;
+    ConstIterator::operator++();
+    return result;
+  }
+
+  Iterator& operator--()
+  {
+    ConstIterator::operator--();
+    return *this;
+  }
+
+  Iterator operator--(int)
+  {
+    auto result = *this;
+    ConstIterator::operator--();
+    return result;
+  }
+
+  pointer operator->() const
+  {
+    return &this->operator*();
+  }
+
+  reference operator*() const
+  {
+    // ugly cast, yet reduces code duplication.
+    return const_cast<reference>(ConstIterator::operator*());
+  }
+};
+
+}
+
+#endif /* AISDI_MAPS_FLATHASHMAP_H */
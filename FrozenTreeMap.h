@@ -0,0 +1,341 @@
+#ifndef AISDI_MAPS_FROZENTREEMAP_H
+#define AISDI_MAPS_FROZENTREEMAP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "TreeMap.h"
+
+namespace aisdi
+{
+
+// allocator handing out memory aligned to a cache line, or to T if that needs more
+template <typename T>
+struct CacheLineAllocator
+{
+  using value_type = T;
+
+  static constexpr std::align_val_t ALIGNMENT=std::align_val_t(alignof(T)>64 ? alignof(T) : 64);
+
+  CacheLineAllocator() = default;
+
+  template <typename U>
+  CacheLineAllocator(const CacheLineAllocator<U>&) {}
+
+  T* allocate(std::size_t n)
+  {
+    return static_cast<T*>(::operator new(n*sizeof(T),ALIGNMENT));
+  }
+
+  void deallocate(T *p, std::size_t)
+  {
+    ::operator delete(p,ALIGNMENT);
+  }
+
+  template <typename U>
+  bool operator==(const CacheLineAllocator<U>&) const
+  {
+    return true;
+  }
+
+  template <typename U>
+  bool operator!=(const CacheLineAllocator<U>&) const
+  {
+    return false;
+  }
+};
+
+// Immutable copy of a TreeMap laid out for searching: the keys are stored in Eytzinger order
+// (the implicit tree of a binary heap, node k has children 2k and 2k+1), so a search walks
+// down one array touching the top levels that always stay cached. The descent is branchless
+// and prefetches the node four levels below, whose 16 keys start a cache line: the array is
+// line aligned and 1 based, so the block of node k's descendants four levels down, keys[16k]
+// to keys[16k+15], fills whole lines.
+// The pairs sit in a second array in the same order; ordered iteration walks the implicit tree.
+template <typename KeyType, typename ValueType>
+class FrozenTreeMap
+{
+public:
+  using key_type = KeyType;
+  using mapped_type = ValueType;
+  using value_type = std::pair<const key_type, mapped_type>;
+  using size_type = std::size_t;
+  using const_reference = const value_type&;
+
+  class ConstIterator;
+  using const_iterator = ConstIterator;
+
+private:
+  // positions are 1 based as in the implicit tree, slot k is keys[k] and entries[k-1]; 0 stands
+  // for end. keys[0] only pads the array and is never compared
+  std::vector<key_type, CacheLineAllocator<key_type>> keys;
+  std::vector<value_type> entries;
+
+  static const size_type PREFETCH_LEVELS=4;
+  static const size_type PREFETCH_KEYS=size_type(1)<<PREFETCH_LEVELS;
+  static const size_type KEYS_PER_LINE= sizeof(key_type)<64 ? 64/sizeof(key_type) : 1;
+
+public:
+  FrozenTreeMap() {}
+
+  // the copy is searched with operator<, so a map ordered by another Compare is sorted first;
+  // keys equivalent under operator< throw std::invalid_argument
+  template <typename Compare>
+  explicit FrozenTreeMap(const TreeMap<key_type, mapped_type, Compare>& map)
+  {
+    std::vector<const value_type*> sorted;
+    sorted.reserve(map.getSize());
+    for(auto it=map.begin();it!=map.end();++it)
+        sorted.push_back(&*it);
+    if constexpr(!orders_by_less<Compare, key_type>::value)
+    {
+        std::sort(sorted.begin(),sorted.end(),[](const value_type *a, const value_type *b) { return a->first < b->first; });
+        for(size_type i=1;i<sorted.size();++i)
+            if(!(sorted[i-1]->first < sorted[i]->first))
+                throw std::invalid_argument("FrozenTreeMap");
+    }
+    build(sorted);
+  }
+
+  // keys must be strictly increasing, std::invalid_argument otherwise
+  template <typename ForwardIt>
+  FrozenTreeMap(ForwardIt first, ForwardIt last)
+  {
+    std::vector<const typename std::iterator_traits<ForwardIt>::value_type*> sorted;
+    for(;first!=last;++first)
+    {
+        if(!sorted.empty() && !(sorted.back()->first < first->first))
+            throw std::invalid_argument("FrozenTreeMap");
+        sorted.push_back(&*first);
+    }
+    build(sorted);
+  }
+
+  size_type getSize() const
+  {
+    return entries.size();
+  }
+
+  bool isEmpty() const
+  {
+    return entries.empty();
+  }
+
+  const_iterator find(const key_type& key) const
+  {
+    size_type k=lower_bound_position(key);
+    if(k!=0 && key < keys[k]) k=0;
+    return ConstIterator(this,k);
+  }
+
+  const mapped_type& valueOf(const key_type& key) const
+  {
+    const_iterator it=find(key);
+    if(it==end())
+        throw std::out_of_range("valueOf");
+    return it->second;
+  }
+
+  // first element whose key is not less than key
+  const_iterator lower_bound(const key_type& key) const
+  {
+    return ConstIterator(this,lower_bound_position(key));
+  }
+
+  // first element whose key is greater than key
+  const_iterator upper_bound(const key_type& key) const
+  {
+    size_type n=entries.size();
+    size_type k=1;
+    while(k<=n)
+    {
+        prefetch(k);
+        k=2*k+!(key < keys[k]);
+    }
+    return ConstIterator(this,climb(k));
+  }
+
+  const_iterator cbegin() const
+  {
+    return ConstIterator(this,leftmost(1));
+  }
+
+  const_iterator cend() const
+  {
+    return ConstIterator(this,0);
+  }
+
+  const_iterator begin() const
+  {
+    return cbegin();
+  }
+
+  const_iterator end() const
+  {
+    return cend();
+  }
+
+private:
+
+  // fills slots in in-order traversal order, which is key order
+  template <typename Pointer>
+  void build(const std::vector<Pointer>& sorted)
+  {
+    size_type n=sorted.size();
+    std::vector<size_type> rank(n);
+    size_type next=0;
+    for(size_type k=leftmost(1,n);k!=0;k=successor(k,n))
+        rank[k-1]=next++;
+    if(n==0) return;
+    keys.reserve(n+1);
+    entries.reserve(n);
+    keys.push_back(sorted[rank[0]]->first);
+    for(size_type k=0;k<n;++k)
+    {
+        keys.push_back(sorted[rank[k]]->first);
+        entries.emplace_back(sorted[rank[k]]->first,sorted[rank[k]]->second);
+    }
+  }
+
+  size_type lower_bound_position(const key_type& key) const
+  {
+    size_type n=entries.size();
+    size_type k=1;
+    while(k<=n)
+    {
+        prefetch(k);
+        k=2*k+(keys[k] < key);
+    }
+    return climb(k);
+  }
+
+  // the descent went right at every trailing 1 bit after its last left turn; undoing those
+  // turns and the left one gives the last node where the answer went left, 0 if it never did
+  static size_type climb(size_type k)
+  {
+    return k>>(__builtin_ctzll(~static_cast<unsigned long long>(k))+1);
+  }
+
+  // every line of the block of keys PREFETCH_LEVELS below k that holds a slot
+  void prefetch(size_type k) const
+  {
+    size_type ahead=k<<PREFETCH_LEVELS;
+    for(size_type i=0;i<PREFETCH_KEYS && ahead+i<=entries.size();i+=KEYS_PER_LINE)
+        __builtin_prefetch(keys.data()+ahead+i);
+  }
+
+  size_type leftmost(size_type k) const
+  {
+    return leftmost(k,entries.size());
+  }
+
+  static size_type leftmost(size_type k, size_type n)
+  {
+    if(k>n) return 0;
+    while(2*k<=n) k=2*k;
+    return k;
+  }
+
+  static size_type rightmost(size_type k, size_type n)
+  {
+    if(k>n) return 0;
+    while(2*k+1<=n) k=2*k+1;
+    return k;
+  }
+
+  static size_type successor(size_type k, size_type n)
+  {
+    if(2*k+1<=n) return leftmost(2*k+1,n);
+    while(k&1) k>>=1;
+    return k>>1;
+  }
+
+  // 0 for the first element
+  static size_type predecessor(size_type k, size_type n)
+  {
+    if(2*k<=n) return rightmost(2*k,n);
+    while(k && !(k&1)) k>>=1;
+    return k>>1;
+  }
+};
+
+template <typename KeyType, typename ValueType>
+class FrozenTreeMap<KeyType, ValueType>::ConstIterator
+{
+public:
+  using reference = typename FrozenTreeMap::const_reference;
+  using iterator_category = std::bidirectional_iterator_tag;
+  using value_type = typename FrozenTreeMap::value_type;
+  using pointer = const typename FrozenTreeMap::value_type*;
+
+  explicit ConstIterator(const FrozenTreeMap *m=nullptr, size_type k=0) : map(m), position(k) {}
+
+  ConstIterator& operator++()
+  {
+    if(map==nullptr || position==0)
+        throw std::out_of_range("++");
+    position=FrozenTreeMap::successor(position,map->entries.size());
+    return *this;
+  }
+
+  ConstIterator operator++(int)
+  {
+    ConstIterator temp=*this;
+    operator++();
+    return temp;
+  }
+
+  ConstIterator& operator--()
+  {
+    if(map==nullptr)
+        throw std::out_of_range("--");
+    size_type n=map->entries.size();
+    size_type previous= position==0 ? FrozenTreeMap::rightmost(1,n) : FrozenTreeMap::predecessor(position,n);
+    if(previous==0)
+        throw std::out_of_range("--");
+    position=previous;
+    return *this;
+  }
+
+  ConstIterator operator--(int)
+  {
+    ConstIterator temp=*this;
+    operator--();
+    return temp;
+  }
+
+  reference operator*() const
+  {
+    if(map==nullptr || position==0)
+        throw std::out_of_range("*");
+    return map->entries[position-1];
+  }
+
+  pointer operator->() const
+  {
+    return &this->operator*();
+  }
+
+  bool operator==(const ConstIterator& other) const
+  {
+    return map==other.map && position==other.position;
+  }
+
+  bool operator!=(const ConstIterator& other) const
+  {
+    return !(*this == other);
+  }
+
+private:
+  const FrozenTreeMap *map;
+  size_type position;
+};
+
+}
+
+#endif /* AISDI_MAPS_FROZENTREEMAP_H */
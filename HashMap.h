@@ -1,22 +1,42 @@
 #ifndef AISDI_MAPS_HASHMAP_H
 #define AISDI_MAPS_HASHMAP_H
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <exception>
 #include <initializer_list>
+#include <iterator>
+#include <new>
 #include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <utility>
 
 #include<vector>
 
+#include "Hashing.h"
+#include "StoredFunctor.h"
+
 namespace aisdi
 {
 
-template <typename KeyType, typename ValueType>
-class HashMap
+// The map keeps its own Hasher and KeyEqual, given to the constructor and copied with the map;
+// stateless ones take no room. A hasher without is_avalanching has its result mixed before the
+// low bits pick a bucket
+template <typename KeyType, typename ValueType,
+          typename Hasher = DefaultHash<KeyType>, typename KeyEqual = DefaultEqual<KeyType>>
+class HashMap : private StoredFunctor<Hasher, 0>, private StoredFunctor<KeyEqual, 1>
 {
 public:
   using key_type = KeyType;
   using mapped_type = ValueType;
+  using hasher = Hasher;
+  using key_equal = KeyEqual;
   using value_type = std::pair<const key_type, mapped_type>;
   using size_type = std::size_t;
   using reference = value_type&;
@@ -28,72 +48,337 @@ public:
   using const_iterator = ConstIterator;
 
 private:
-    std::vector<value_type> *mapa; //tablica wektorow
+    using StoredHasher = StoredFunctor<hasher, 0>;
+    using StoredEqual = StoredFunctor<key_equal, 1>;
+
+    // lookups taking any K the hash and equality accept without converting it to key_type
+    template <typename K>
+    using if_transparent = typename std::enable_if<is_transparent_lookup<hasher, key_equal, K>::value>::type;
+
+    struct Entry
+    {
+        value_type data;
+        size_t hash; //full hash of data.first, compared before the keys and reused by rehash
+
+        template <typename... Args>
+        explicit Entry(size_t h, Args&&... args) : data(std::forward<Args>(args)...), hash(h) {}
+    };
+
+    std::vector<Entry> *mapa; //tablica wektorow
+    std::uint64_t *occupied; //bit per non-empty bucket of mapa
     size_t TABLE_SIZE;
     size_t Size;
+    size_t first_used; //first non-empty bucket, TABLE_SIZE if none
+    size_t end_used; //one past the last non-empty bucket, 0 if none
+    float max_load;
+
+    // incremental rehash: buckets of the previous table which still wait to be moved into mapa.
+    // Only inserts move them, so const members read both tables and never write
+    std::vector<Entry> *old_mapa;
+    size_t OLD_TABLE_SIZE;
+    size_t migrated; //buckets of old_mapa below this one are already moved and empty
+
+    // small mode: up to SMALL_LIMIT entries in single_bucket, the only bucket of a map that has no
+    // table yet; mapa and occupied then point at these members. It is not inline storage: the
+    // bucket is an ordinary vector, so the first insert allocates room for SMALL_LIMIT entries on
+    // the heap, and every map carries the vector itself even while empty
+    std::vector<Entry> single_bucket;
+    std::uint64_t small_bits;
+
+    static const size_t SMALL_LIMIT=8;
+    static const size_t MIN_TABLE_SIZE=16; //first real table, when small mode overflows
+    static const size_t REHASH_STEP=8; //buckets moved per insert
+    static const size_t BATCH=16; //keys in flight per batched lookup round
+    static const size_t PARALLEL_MIN=32768; //smaller insertRange() inputs are not worth the partitioning
+    static const size_t PARTITIONS_PER_THREAD=8; //bucket runs per thread, so uneven runs even out
+
+template <typename K>
+size_t Hash(const K &key) const
+    {
+        if constexpr(is_avalanching<hasher>::value)
+            return StoredHasher::get()(key);
+        else
+            return size_t(mix64(StoredHasher::get()(key)));
+    }
 
-size_t Hash(const key_type &key) const
+// tables are powers of two, so the bucket is just the low bits of the hash
+static size_t Bucket(size_t hash, size_t table_size)
     {
-        std::hash <key_type> make_hash;
-        return ((make_hash(key))% TABLE_SIZE);
+        return hash & (table_size-1);
     }
 
+    // a map without any table, as made by HashMap() or left behind by a move; the first insert
+    // switches to small mode
+    struct Unallocated {};
+
+    explicit HashMap(Unallocated, const hasher& hash=hasher(), const key_equal& equal=key_equal())
+      : StoredHasher(hash), StoredEqual(equal), mapa(nullptr), occupied(nullptr), TABLE_SIZE(0), Size(0),
+      first_used(0), end_used(0), max_load(1.0f), old_mapa(nullptr), OLD_TABLE_SIZE(0), migrated(0), small_bits(0)
+    {}
+
+    // moves only copy the functors, so other stays usable
+    static constexpr bool NOTHROW_FUNCTORS=
+      std::is_nothrow_copy_constructible<hasher>::value && std::is_nothrow_copy_assignable<hasher>::value
+      && std::is_nothrow_copy_constructible<key_equal>::value && std::is_nothrow_copy_assignable<key_equal>::value;
+
 public:
 
-  HashMap() : mapa(nullptr), TABLE_SIZE(16384), Size(0)
+  // allocates nothing until the first insert
+  HashMap() : HashMap(Unallocated()) {}
+
+  // a bucket_count of 0 allocates nothing until the first insert, as HashMap() does
+  explicit HashMap(size_type bucket_count, const hasher& hash=hasher(), const key_equal& equal=key_equal())
+    : HashMap(Unallocated(),hash,equal)
   {
-    mapa=new std::vector<value_type>[TABLE_SIZE];
+    if(bucket_count==0) return;
+    size_t size=round_up(bucket_count);
+    mapa=new std::vector<Entry>[size];
+    TABLE_SIZE=size;
+    first_used=TABLE_SIZE;
+    occupied=new std::uint64_t[words(TABLE_SIZE)]();
   }
 
   HashMap(std::initializer_list<value_type> list) : HashMap()
   {
+    reserve(list.size());
     for(auto it=list.begin();it!=list.end();++it)
         this->operator[](it->first)=it->second;
   }
 
-  HashMap(const HashMap& other) : HashMap()
+  // clones the bucket array as is, same table size and bucket order, without rehashing anything;
+  // entries still waiting in other's old table go straight to their buckets in the copy
+  HashMap(const HashMap& other) : HashMap(Unallocated(),other.StoredHasher::get(),other.StoredEqual::get())
   {
-    for(auto it=other.begin();it!=other.end();++it)
-        this->operator[](it->first)=it->second;
+    max_load=other.max_load;
+    if(other.mapa==nullptr) return;
+    if(other.is_small())
+    {
+        enter_small_mode();
+        for(auto it=other.single_bucket.begin();it!=other.single_bucket.end();++it)
+            single_bucket.push_back(*it);
+        small_bits=other.small_bits;
+        first_used=other.first_used;
+        end_used=other.end_used;
+        Size=other.Size;
+        return;
+    }
+    mapa=new std::vector<Entry>[other.TABLE_SIZE];
+    TABLE_SIZE=other.TABLE_SIZE;
+    occupied=new std::uint64_t[words(TABLE_SIZE)];
+    std::copy(other.occupied,other.occupied+words(TABLE_SIZE),occupied);
+    first_used=other.first_used;
+    end_used=other.end_used;
+    for(size_t h=other.first_used;h<other.end_used;h=other.next_used(h))
+        mapa[h]=std::vector<Entry>(other.mapa[h]);
+    for(size_t h=other.migrated;h<other.OLD_TABLE_SIZE;++h)
+        for(auto it=other.old_mapa[h].begin();it!=other.old_mapa[h].end();++it)
+        {
+            size_t b=Bucket(it->hash,TABLE_SIZE);
+            mapa[b].push_back(*it);
+            mark_used(b);
+        }
+    Size=other.Size;
   }
 
-  HashMap(HashMap&& other) : HashMap()
+  // O(1) and allocation free; other is left empty, without a table until it is used again
+  HashMap(HashMap&& other) noexcept(NOTHROW_FUNCTORS)
+    : HashMap(Unallocated(),other.StoredHasher::get(),other.StoredEqual::get())
   {
     *this=std::move(other);
   }
 
   ~HashMap()
   {
-    delete[] mapa;
+    free_tables();
     Size=0;
   }
 
   HashMap& operator=(const HashMap& other)
   {
-    if(*this==other) return *this;
-    delete[] mapa;
-    Size=0;
-    mapa=new std::vector<value_type>[TABLE_SIZE];
-    for(auto it=other.begin();it!=other.end();++it)
-        this->operator[](it->first)=it->second;
-    return *this;
+    if(this==&other) return *this;
+    HashMap copy(other);
+    return *this=std::move(copy);
   }
 
-  HashMap& operator=(HashMap&& other)
+  HashMap& operator=(HashMap&& other) noexcept(NOTHROW_FUNCTORS)
   {
-    if(*this==other) return *this;
-    delete[] mapa;
-    mapa=other.mapa;
+    if(this==&other) return *this;
+    StoredHasher::operator=(other);
+    StoredEqual::operator=(other);
+    free_tables();
+    if(other.is_small())
+    {
+        single_bucket=std::move(other.single_bucket);
+        enter_small_mode();
+        small_bits=other.small_bits;
+    }
+    else
+    {
+        mapa=other.mapa;
+        occupied=other.occupied;
+    }
     Size=other.Size;
     TABLE_SIZE=other.TABLE_SIZE;
+    first_used=other.first_used;
+    end_used=other.end_used;
+    max_load=other.max_load;
+    old_mapa=other.old_mapa;
+    OLD_TABLE_SIZE=other.OLD_TABLE_SIZE;
+    migrated=other.migrated;
 
     other.mapa=nullptr;
+    other.occupied=nullptr;
+    other.small_bits=0;
     other.Size=0;
     other.TABLE_SIZE=0;
+    other.first_used=0;
+    other.end_used=0;
+    other.old_mapa=nullptr;
+    other.OLD_TABLE_SIZE=0;
+    other.migrated=0;
 
     return *this;
   }
 
+  hasher hash_function() const
+  {
+    return StoredHasher::get();
+  }
+
+  key_equal key_eq() const
+  {
+    return StoredEqual::get();
+  }
+
+  float max_load_factor() const
+  {
+    return max_load;
+  }
+
+  void max_load_factor(float ml)
+  {
+    if(!(ml>0))
+        throw std::invalid_argument("max_load_factor");
+    max_load=ml;
+    if(!is_small() && Size>max_load*TABLE_SIZE)
+        rehash(0);
+  }
+
+  float load_factor() const
+  {
+    return TABLE_SIZE ? float(Size)/TABLE_SIZE : 0.0f;
+  }
+
+  size_type bucket_count() const
+  {
+    return TABLE_SIZE;
+  }
+
+  struct Stats
+  {
+    size_type size;
+    size_type bucketCount;
+    float loadFactor;
+    size_type maxChain;
+    double emptyBucketRatio;
+    std::vector<size_type> chainHistogram; //chainHistogram[n] buckets hold n entries, up to maxChain
+    size_type bytesAllocated; //the map object, its table and bitmap, and every bucket's capacity
+  };
+
+  // walks the whole table, O(bucket_count()). While a rehash is pending the histogram covers
+  // the new table only, the old one still counts in bytesAllocated
+  Stats stats() const
+  {
+    Stats result{Size,TABLE_SIZE,load_factor(),0,0.0,{},sizeof(*this)};
+    if(mapa==nullptr) return result;
+    if(!is_small())
+        result.bytesAllocated+=TABLE_SIZE*sizeof(std::vector<Entry>)+words(TABLE_SIZE)*sizeof(std::uint64_t)
+                               +single_bucket.capacity()*sizeof(Entry);
+    result.bytesAllocated+=OLD_TABLE_SIZE*sizeof(std::vector<Entry>);
+    for(size_t h=migrated;h<OLD_TABLE_SIZE;++h)
+        result.bytesAllocated+=old_mapa[h].capacity()*sizeof(Entry);
+    size_type empty=0;
+    for(size_t h=0;h<TABLE_SIZE;++h)
+    {
+        size_type length=mapa[h].size();
+        if(length>=result.chainHistogram.size())
+            result.chainHistogram.resize(length+1);
+        ++result.chainHistogram[length];
+        if(length==0) ++empty;
+        if(length>result.maxChain) result.maxChain=length;
+        result.bytesAllocated+=mapa[h].capacity()*sizeof(Entry);
+    }
+    result.emptyBucketRatio=double(empty)/TABLE_SIZE;
+    return result;
+  }
+
+  // a run of bucket positions (see bucket_at()), for scans split over threads (see Parallel.h); a slice only reads, so
+  // any number of them can be walked at once as long as the map is not modified
+  class Slice
+  {
+  public:
+    static const size_t GRAIN=4096; //buckets below which a slice is not split further
+
+    bool divisible() const
+    {
+      return last-first>GRAIN;
+    }
+
+    // two halves by bucket index, in iteration order
+    std::pair<Slice,Slice> split() const
+    {
+      size_t middle=first+(last-first)/2;
+      return std::make_pair(Slice(map,first,middle),Slice(map,middle,last));
+    }
+
+    // calls visit(const value_type&) for every element in the slice's buckets
+    template <typename Visitor>
+    void forEach(Visitor&& visit) const
+    {
+      for(size_t h=first;h<last;++h)
+      {
+        const std::vector<Entry>& bucket=map->bucket_at(h);
+        for(auto it=bucket.begin();it!=bucket.end();++it)
+          visit(it->data);
+      }
+    }
+
+  private:
+    friend class HashMap;
+
+    Slice(const HashMap *m, size_t f, size_t l) : map(m), first(f), last(l) {}
+
+    const HashMap *map;
+    size_t first;
+    size_t last;
+  };
+
+  // every non-empty bucket as one slice, those of a pending rehash's old table included
+  Slice slice() const
+  {
+    return Slice(this,first_position(),end_position());
+  }
+
+  // rebuilds the table right away with at least n buckets (and enough for max_load_factor)
+  void rehash(size_type n)
+  {
+    complete_rehash();
+    size_t needed=size_t(std::ceil(Size/max_load));
+    size_t new_size=round_up(n>needed ? n : needed);
+    if(new_size==TABLE_SIZE) return;
+    start_rehash(new_size);
+    complete_rehash();
+  }
+
+  // makes room for n elements without further growth
+  void reserve(size_type n)
+  {
+    if(n<=SMALL_LIMIT && (mapa==nullptr || is_small())) return;
+    size_t needed=size_t(std::ceil(n/max_load));
+    if(needed>TABLE_SIZE)
+        rehash(needed);
+  }
+
   bool isEmpty() const
   {
     return !Size;
@@ -101,96 +386,246 @@ public:
 
   mapped_type& operator[](const key_type& key)
   {
-    int h=Hash(key);
-    for(auto it=mapa[h].begin();it!=mapa[h].end();++it)
+    return subscript(key);
+  }
+
+  mapped_type& operator[](key_type&& key)
+  {
+    return subscript(std::move(key));
+  }
+
+  template <typename K, typename = if_transparent<K>>
+  mapped_type& operator[](const K& key)
+  {
+    return subscript(key);
+  }
+
+  // constructs the value in place from args if key is absent; on a hit nothing is constructed
+  // and args are left untouched. Grows the table step by step, as operator[] does
+  template <typename... Args>
+  std::pair<iterator,bool> try_emplace(const key_type& key, Args&&... args)
+  {
+    return emplace_key(key,std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  std::pair<iterator,bool> try_emplace(key_type&& key, Args&&... args)
+  {
+    return emplace_key(std::move(key),std::forward<Args>(args)...);
+  }
+
+  // inserts, or assigns to the value already there; the bool tells which
+  template <typename M>
+  std::pair<iterator,bool> insert_or_assign(const key_type& key, M&& value)
+  {
+    auto result=emplace_key(key,std::forward<M>(value));
+    if(!result.second) result.first->second=std::forward<M>(value);
+    return result;
+  }
+
+  template <typename M>
+  std::pair<iterator,bool> insert_or_assign(key_type&& key, M&& value)
+  {
+    auto result=emplace_key(std::move(key),std::forward<M>(value));
+    if(!result.second) result.first->second=std::forward<M>(value);
+    return result;
+  }
+
+  // insert_or_assign() for every pair of [first, last), later pairs winning for equal keys, with
+  // the table sized once for all of them. From PARALLEL_MIN pairs on, with random access iterators,
+  // the pairs are hashed, grouped by the run of buckets they fall into and inserted run by run,
+  // which walks the table in order even on one thread; up to threads threads (0 for one per core)
+  // share the work, filling disjoint runs of buckets without locks. If an exception escapes,
+  // the pairs inserted so far stay
+  template <typename ForwardIt>
+  void insertRange(ForwardIt first, ForwardIt last, unsigned threads=0)
+  {
+    size_type n=std::distance(first,last);
+    reserve(Size+n);
+    if constexpr(std::is_base_of<std::random_access_iterator_tag,
+                                 typename std::iterator_traits<ForwardIt>::iterator_category>::value)
     {
-        if((*it).first==key) return (*it).second;
+        if(threads==0) threads=std::thread::hardware_concurrency();
+        if(threads==0) threads=1;
+        if(n>=PARALLEL_MIN && !is_small())
+        {
+            complete_rehash(); //parallel_insert() only looks in mapa
+            parallel_insert(first,n,threads);
+            return;
+        }
     }
-    mapa[h].push_back(value_type(key,mapped_type{}));
-    ++Size;
-    return mapa[h].back().second;
+    for(;first!=last;++first)
+        insert_or_assign(first->first,first->second);
   }
 
-  const mapped_type& valueOf(const key_type& key) const
+  // args as for value_type; a key and a value, or a pair, are looked up before anything is built,
+  // anything else is built on the stack first to learn the key
+  template <typename First, typename... Rest>
+  std::pair<iterator,bool> emplace(First&& first, Rest&&... rest)
   {
-    size_t h=Hash(key);
-    for(auto it=mapa[h].begin();it!=mapa[h].end();++it)
+    if constexpr(sizeof...(Rest)==1 && std::is_same<typename std::decay<First>::type,key_type>::value)
+        return emplace_key(std::forward<First>(first),std::forward<Rest>(rest)...);
+    else if constexpr(sizeof...(Rest)==0 && is_pair<typename std::decay<First>::type>::value)
+        return emplace_key(std::forward<First>(first).first,std::forward<First>(first).second);
+    else
     {
-        if((*it).first==key) return (*it).second;
+        value_type temp(std::forward<First>(first),std::forward<Rest>(rest)...);
+        return emplace_key(temp.first,std::move(temp.second));
     }
-    throw std::out_of_range("valueOf");
+  }
+
+  const mapped_type& valueOf(const key_type& key) const
+  {
+    return value_of(key);
+  }
+
+  template <typename K, typename = if_transparent<K>>
+  const mapped_type& valueOf(const K& key) const
+  {
+    return value_of(key);
   }
 
   mapped_type& valueOf(const key_type& key)
   {
-    size_t h=Hash(key);
-    for(auto it=mapa[h].begin();it!=mapa[h].end();++it)
-    {
-        if((*it).first==key) return (*it).second;
-    }
-    throw std::out_of_range("valueOf");
+    return value_of(key);
+  }
+
+  template <typename K, typename = if_transparent<K>>
+  mapped_type& valueOf(const K& key)
+  {
+    return value_of(key);
+  }
+
+  // the non-throwing lookups: a miss costs what a hit does
+  bool contains(const key_type& key) const
+  {
+    return find_entry(key,Hash(key))!=nullptr;
+  }
+
+  template <typename K, typename = if_transparent<K>>
+  bool contains(const K& key) const
+  {
+    return find_entry(key,Hash(key))!=nullptr;
+  }
+
+  // pointer to the value, nullptr on a miss; valid until the map is next modified
+  const mapped_type* tryGet(const key_type& key) const
+  {
+    return try_get(key);
+  }
+
+  template <typename K, typename = if_transparent<K>>
+  const mapped_type* tryGet(const K& key) const
+  {
+    return try_get(key);
+  }
+
+  mapped_type* tryGet(const key_type& key)
+  {
+    return try_get(key);
+  }
+
+  template <typename K, typename = if_transparent<K>>
+  mapped_type* tryGet(const K& key)
+  {
+    return try_get(key);
   }
 
   const_iterator find(const key_type& key) const
   {
-    size_t h=Hash(key);
-    if(Size==0 || mapa[h].size()==0) return end();
-    size_t i=0;
-    for(;i<mapa[h].size();++i)
-        if(mapa[h][i].first==key) break;
+    return find_iterator(key);
+  }
 
-    ConstIterator it(mapa,h,i);
-    return it;
+  template <typename K, typename = if_transparent<K>>
+  const_iterator find(const K& key) const
+  {
+    return find_iterator(key);
   }
 
   iterator find(const key_type& key)
   {
-    size_t h=Hash(key);
-
-    if(Size==0 || mapa[h].size()==0) return end();
-    size_t i=0;
-    for(;i<mapa[h].size();++i)
-        if(mapa[h][i].first==key) break;
+    return Iterator(find_iterator(key));
+  }
 
-    Iterator it(mapa,h,i);
-    return it;
+  template <typename K, typename = if_transparent<K>>
+  iterator find(const K& key)
+  {
+    return Iterator(find_iterator(key));
   }
 
   void remove(const key_type& key)
   {
-    if(Size==0)
+    if(!erase_key(key))
         throw std::out_of_range("remove");
-    size_t h=Hash(key);
-    if(mapa[h].size()==0)
+  }
+
+  template <typename K, typename = if_transparent<K>>
+  void remove(const K& key)
+  {
+    if(!erase_key(key))
         throw std::out_of_range("remove");
-    size_t i=mapa[h].size()-1;
-    std::vector<value_type> temp;
-    for(;i>=0;--i)
-    {
-        if(mapa[h][i].first==key)
-        {
-            mapa[h].pop_back();
-            --Size;
-            break;
-        }
-        value_type popped=mapa[h].back();
-        temp.push_back(popped);
-        mapa[h].pop_back();
-    }
-    while(temp.size()>0)
-    {
-        mapa[h].push_back(temp.back());
-        temp.pop_back();
-    }
+  }
+
+  // remove() that does not throw, returns how many elements went (0 or 1)
+  size_type erase(const key_type& key)
+  {
+    return erase_key(key) ? 1 : 0;
+  }
+
+  template <typename K, typename = if_transparent<K>>
+  size_type erase(const K& key)
+  {
+    return erase_key(key) ? 1 : 0;
   }
 
   void remove(const const_iterator& it)
   {
-    if(it==end())
-        throw std::out_of_range("remove");
-    size_t h=it.hash_index;
-    const key_type &key=mapa[h][it.vec_index].first;
-    remove(key);
+    erase(it);
+  }
+
+  // O(1): the last entry of the bucket takes the erased one's place. Returns the iterator
+  // to the element that comes next, so erasing while sweeping visits everything once
+  iterator erase(const const_iterator& it)
+  {
+    if(it.map!=this || it==end())
+        throw std::out_of_range("erase");
+    size_t position=it.hash_index;
+    size_t v=it.vec_index;
+    bool in_old=position<OLD_TABLE_SIZE;
+    std::vector<Entry> &bucket= in_old ? old_mapa[position] : mapa[position-OLD_TABLE_SIZE];
+    erase_at(bucket,v);
+    --Size;
+    if(v<bucket.size())
+        return Iterator(this,position,v);
+    if(!in_old && bucket.empty()) mark_empty(position-OLD_TABLE_SIZE);
+    return Iterator(this,position_from(position+1),0);
+  }
+
+  // find() for n keys at once: results[i] is the iterator for keys[i], end() on a miss
+  void findBatch(const key_type *keys, size_type n, const_iterator *results) const
+  {
+    const const_iterator missing=end();
+    lookup_batch(keys,n,[&](size_type i, size_t hash) {
+        size_t position, v;
+        results[i]= locate(keys[i],hash,position,v) ? ConstIterator(this,position,v) : missing;
+    });
+  }
+
+  // valueOf() for n keys at once without throwing: found[i] tells whether values[i] was written,
+  // returns the number of hits
+  size_type valueOfBatch(const key_type *keys, size_type n, mapped_type *values, bool *found) const
+  {
+    size_type hits=0;
+    lookup_batch(keys,n,[&](size_type i, size_t hash) {
+        const Entry *entry=find_entry(keys[i],hash);
+        found[i]=entry!=nullptr;
+        if(entry)
+        {
+            values[i]=entry->data.second;
+            ++hits;
+        }
+    });
+    return hits;
   }
 
   size_type getSize() const
@@ -202,11 +637,10 @@ public:
   {
     if(Size!=other.Size)
         return false;
-    auto it=begin();
     for(auto ito=other.begin();ito!=other.end();++ito)
     {
-        if(*it!=*ito) return false;
-        ++it;
+        const Entry *found=find_entry(ito->first,Hash(ito->first));
+        if(found==nullptr || found->data.second!=ito->second) return false;
     }
     return true;
   }
@@ -216,49 +650,38 @@ public:
     return !(*this == other);
   }
 
+  // bucket positions of begin() and end(), see bucket_at()
   size_t first_index() const
   {
-    if(Size==0) return 0;
-    size_t h=0;
-
-    while(h<TABLE_SIZE && mapa[h].size()==0)
-        h++;
-
-    return h;
+    return first_position();
   }
 
   size_t last_index() const
   {
-    if(Size==0) return 0;
-    size_t h=TABLE_SIZE-1;
-
-    while(h>=0 && mapa[h].size()==0)
-        --h;
-
-    return ++h;
+    return end_position();
   }
 
   iterator begin()
   {
-    Iterator it(mapa,first_index(),0);
+    Iterator it(this,first_index(),0);
     return it;
   }
 
   iterator end()
   {
-    Iterator it(mapa,last_index(),0);
+    Iterator it(this,last_index(),0);
     return it;
   }
 
   const_iterator cbegin() const
   {
-    ConstIterator it(mapa,first_index());
+    ConstIterator it(this,first_index(),0);
     return it;
   }
 
   const_iterator cend() const
   {
-    ConstIterator it(mapa,last_index());
+    ConstIterator it(this,last_index(),0);
     return it;
   }
 
@@ -271,10 +694,542 @@ public:
   {
     return cend();
   }
+
+private:
+
+  static size_t words(size_t table_size)
+  {
+    return (table_size+63)/64;
+  }
+
+  void mark_used(size_t h)
+  {
+    occupied[h/64]|=std::uint64_t(1)<<(h%64);
+    if(h<first_used) first_used=h;
+    if(h>=end_used) end_used=h+1;
+  }
+
+  // runs work(t) for every t in [0, threads), the calling thread taking t=0 and any t no thread
+  // could be started for; rethrows the first exception once all of them are done
+  template <typename Work>
+  static void run_threads(unsigned threads, Work work)
+  {
+    std::vector<std::exception_ptr> errors(threads);
+    auto guarded=[&](unsigned t) {
+        try
+        {
+            work(t);
+        }
+        catch(...)
+        {
+            errors[t]=std::current_exception();
+        }
+    };
+    std::vector<std::thread> workers;
+    workers.reserve(threads);
+    for(unsigned t=1;t<threads;++t)
+    {
+        try
+        {
+            workers.emplace_back(guarded,t);
+        }
+        catch(const std::system_error&)
+        {
+            guarded(t);
+        }
+    }
+    guarded(0);
+    for(auto it=workers.begin();it!=workers.end();++it)
+        it->join();
+    for(auto it=errors.begin();it!=errors.end();++it)
+        if(*it) std::rethrow_exception(*it);
+  }
+
+  // the table is already big enough for all n pairs and has no rehash pending. The buckets are
+  // split into runs of at least 64, so no two runs share a word of occupied. Every thread hashes
+  // its slice of the input and counts it per run; the counts give each (run, thread) pair its
+  // place, so scattering keeps the input order within a run. Then the threads take whole runs and
+  // insert them
+  template <typename RandomIt>
+  void parallel_insert(RandomIt first, size_type n, unsigned threads)
+  {
+    size_t runs=round_up(size_t(threads)*PARTITIONS_PER_THREAD);
+    while(runs>1 && TABLE_SIZE/runs<64) runs/=2;
+    size_t shift=0;
+    while((size_t(1)<<shift)<TABLE_SIZE/runs) ++shift;
+
+    auto slice=[n,threads](unsigned t) { return n*t/threads; };
+    std::vector<size_t> hashes(n);
+    std::vector<size_t> offsets(size_t(threads)*runs);
+    run_threads(threads,[&](unsigned t) {
+        size_t *count=&offsets[size_t(t)*runs];
+        for(size_t i=slice(t);i<slice(t+1);++i)
+        {
+            hashes[i]=Hash(first[i].first);
+            ++count[Bucket(hashes[i],TABLE_SIZE)>>shift];
+        }
+    });
+
+    std::vector<size_t> run_begin(runs+1);
+    size_t offset=0;
+    for(size_t r=0;r<runs;++r)
+    {
+        run_begin[r]=offset;
+        for(unsigned t=0;t<threads;++t)
+        {
+            size_t count=offsets[size_t(t)*runs+r];
+            offsets[size_t(t)*runs+r]=offset;
+            offset+=count;
+        }
+    }
+    run_begin[runs]=n;
+
+    std::vector<size_t> order(n);
+    run_threads(threads,[&](unsigned t) {
+        size_t *next=&offsets[size_t(t)*runs];
+        for(size_t i=slice(t);i<slice(t+1);++i)
+            order[next[Bucket(hashes[i],TABLE_SIZE)>>shift]++]=i;
+    });
+
+    struct alignas(64) Progress
+    {
+        size_t added, lowest, highest; //new entries and the span of buckets they went to
+    };
+    std::vector<Progress> progress(threads,Progress{0,TABLE_SIZE,0});
+    std::atomic<size_t> next_run(0);
+    auto merge=[&] {
+        for(auto it=progress.begin();it!=progress.end();++it)
+        {
+            Size+=it->added;
+            if(it->lowest<first_used) first_used=it->lowest;
+            if(it->highest>end_used) end_used=it->highest;
+        }
+    };
+    try
+    {
+        run_threads(threads,[&](unsigned t) {
+            Progress& mine=progress[t];
+            for(size_t r=next_run++;r<runs;r=next_run++)
+                for(size_t j=run_begin[r];j<run_begin[r+1];++j)
+                {
+                    size_t i=order[j];
+                    size_t hash=hashes[i];
+                    size_t h=Bucket(hash,TABLE_SIZE);
+                    Entry *found=find_in(mapa[h],first[i].first,hash);
+                    if(found)
+                    {
+                        found->data.second=first[i].second;
+                        continue;
+                    }
+                    mapa[h].emplace_back(hash,first[i].first,first[i].second);
+                    occupied[h/64]|=std::uint64_t(1)<<(h%64);
+                    ++mine.added;
+                    if(h<mine.lowest) mine.lowest=h;
+                    if(h+1>mine.highest) mine.highest=h+1;
+                }
+        });
+    }
+    catch(...)
+    {
+        merge();
+        throw;
+    }
+    merge();
+  }
+
+  void mark_empty(size_t h)
+  {
+    occupied[h/64]&=~(std::uint64_t(1)<<(h%64));
+    if(h==first_used) first_used=next_used(h);
+    if(h+1==end_used)
+    {
+        size_t prev=prev_used(h);
+        end_used= prev==TABLE_SIZE ? 0 : prev+1;
+    }
+  }
+
+  // first non-empty bucket after h, TABLE_SIZE if none
+  size_t next_used(size_t h) const
+  {
+    ++h;
+    if(h>=TABLE_SIZE) return TABLE_SIZE;
+    size_t w=h/64;
+    std::uint64_t bits=occupied[w] & (~std::uint64_t(0)<<(h%64));
+    while(!bits)
+    {
+        if(++w==words(TABLE_SIZE)) return TABLE_SIZE;
+        bits=occupied[w];
+    }
+    return w*64+__builtin_ctzll(bits);
+  }
+
+  // last non-empty bucket before h, TABLE_SIZE if none
+  size_t prev_used(size_t h) const
+  {
+    if(h==0) return TABLE_SIZE;
+    --h;
+    size_t w=h/64;
+    std::uint64_t bits=occupied[w] & (~std::uint64_t(0)>>(63-h%64));
+    while(!bits)
+    {
+        if(w--==0) return TABLE_SIZE;
+        bits=occupied[w];
+    }
+    return w*64+63-__builtin_clzll(bits);
+  }
+
+  // iterators and slices number buckets by position: first the OLD_TABLE_SIZE buckets of a pending
+  // rehash's old table, then those of mapa, so they walk both tables without moving anything.
+  // Without a pending rehash a position is just the bucket index
+  const std::vector<Entry>& bucket_at(size_t position) const
+  {
+    return position<OLD_TABLE_SIZE ? old_mapa[position] : mapa[position-OLD_TABLE_SIZE];
+  }
+
+  size_t first_position() const
+  {
+    return position_from(0);
+  }
+
+  size_t end_position() const
+  {
+    return Size==0 ? 0 : OLD_TABLE_SIZE+end_used;
+  }
+
+  // first non-empty bucket at or after position, end_position() if none
+  size_t position_from(size_t position) const
+  {
+    if(Size==0) return 0;
+    for(position=std::max(position,migrated);position<OLD_TABLE_SIZE;++position)
+        if(!old_mapa[position].empty()) return position;
+    size_t h=position-OLD_TABLE_SIZE;
+    h= h==0 ? first_used : next_used(h-1);
+    return h<TABLE_SIZE ? OLD_TABLE_SIZE+h : end_position();
+  }
+
+  // moves position back to the last non-empty bucket before it, false if there is none
+  bool position_before(size_t &position) const
+  {
+    if(position>OLD_TABLE_SIZE)
+    {
+        size_t h=prev_used(position-OLD_TABLE_SIZE);
+        if(h!=TABLE_SIZE)
+        {
+            position=OLD_TABLE_SIZE+h;
+            return true;
+        }
+    }
+    for(size_t p=std::min(position,OLD_TABLE_SIZE);p>migrated;)
+        if(!old_mapa[--p].empty())
+        {
+            position=p;
+            return true;
+        }
+    return false;
+  }
+
+  static size_t round_up(size_t n)
+  {
+    size_t size=1;
+    while(size<n) size<<=1;
+    return size;
+  }
+
+  template <typename T>
+  struct is_pair : std::false_type {};
+
+  template <typename A, typename B>
+  struct is_pair<std::pair<A,B>> : std::true_type {};
+
+  // emplace_key() with a value initialized value, returning just the value
+  template <typename K>
+  mapped_type& subscript(K&& key)
+  {
+    size_t hash=Hash(key);
+    Entry *found=find_entry(key,hash);
+    if(found) return found->data.second;
+
+    grow_if_needed();
+    size_t h=Bucket(hash,TABLE_SIZE);
+    mapa[h].emplace_back(hash,std::piecewise_construct,std::forward_as_tuple(std::forward<K>(key)),std::forward_as_tuple());
+    mark_used(h);
+    ++Size;
+    return mapa[h].back().data.second;
+  }
+
+  template <typename K, typename... Args>
+  std::pair<iterator,bool> emplace_key(K&& key, Args&&... args)
+  {
+    size_t hash=Hash(key);
+    size_t position, v;
+    if(locate(key,hash,position,v))
+        return std::make_pair(Iterator(this,position,v),false);
+
+    grow_if_needed();
+    size_t h=Bucket(hash,TABLE_SIZE);
+    mapa[h].emplace_back(hash,std::piecewise_construct,std::forward_as_tuple(std::forward<K>(key)),
+                         std::forward_as_tuple(std::forward<Args>(args)...));
+    mark_used(h);
+    ++Size;
+    return std::make_pair(Iterator(this,OLD_TABLE_SIZE+h,mapa[h].size()-1),true);
+  }
+
+  template <typename K>
+  mapped_type& value_of(const K& key) const
+  {
+    Entry *found=find_entry(key,Hash(key));
+    if(found==nullptr)
+        throw std::out_of_range("valueOf");
+    return found->data.second;
+  }
+
+  template <typename K>
+  const_iterator find_iterator(const K& key) const
+  {
+    size_t position, v;
+    if(!locate(key,Hash(key),position,v)) return end();
+    return ConstIterator(this,position,v);
+  }
+
+  template <typename K>
+  mapped_type* try_get(const K& key) const
+  {
+    Entry *found=find_entry(key,Hash(key));
+    return found ? &found->data.second : nullptr;
+  }
+
+  template <typename K>
+  bool erase_key(const K& key)
+  {
+    if(Size==0) return false;
+    size_t hash=Hash(key);
+    if(old_mapa && remove_from(old_mapa[Bucket(hash,OLD_TABLE_SIZE)],key,hash))
+        return true;
+    size_t h=Bucket(hash,TABLE_SIZE);
+    if(!remove_from(mapa[h],key,hash))
+        return false;
+    if(mapa[h].size()==0) mark_empty(h);
+    return true;
+  }
+
+  // hashes a group of keys and prefetches their bucket headers, then the entries those point to,
+  // so the cache misses of the whole group overlap; visit(i, hash) then does each lookup proper
+  template <typename Visit>
+  void lookup_batch(const key_type *keys, size_type n, Visit visit) const
+  {
+    size_t hashes[BATCH];
+    for(size_type first=0;first<n;first+=BATCH)
+    {
+        size_type count= n-first<BATCH ? n-first : BATCH;
+        if(Size!=0)
+        {
+            for(size_type j=0;j<count;++j)
+            {
+                hashes[j]=Hash(keys[first+j]);
+                __builtin_prefetch(&mapa[Bucket(hashes[j],TABLE_SIZE)]);
+            }
+            for(size_type j=0;j<count;++j)
+            {
+                const std::vector<Entry> &bucket=mapa[Bucket(hashes[j],TABLE_SIZE)];
+                if(!bucket.empty()) __builtin_prefetch(bucket.data());
+            }
+        }
+        else
+            for(size_type j=0;j<count;++j)
+                hashes[j]=0;
+        for(size_type j=0;j<count;++j)
+            visit(first+j,hashes[j]);
+    }
+  }
+
+  template <typename K>
+  Entry* find_in(std::vector<Entry> &bucket, const K& key, size_t hash) const
+  {
+    for(auto it=bucket.begin();it!=bucket.end();++it)
+        if(it->hash==hash && StoredEqual::get()(it->data.first,key)) return &*it;
+    return nullptr;
+  }
+
+  template <typename K>
+  Entry* find_entry(const K& key, size_t hash) const
+  {
+    if(Size==0) return nullptr;
+    if(old_mapa)
+    {
+        Entry *found=find_in(old_mapa[Bucket(hash,OLD_TABLE_SIZE)],key,hash);
+        if(found) return found;
+    }
+    return find_in(mapa[Bucket(hash,TABLE_SIZE)],key,hash);
+  }
+
+  // bucket position and index in the bucket of key's entry, false if it is absent
+  template <typename K>
+  bool locate(const K& key, size_t hash, size_t &position, size_t &v) const
+  {
+    if(Size==0) return false;
+    if(old_mapa)
+    {
+        size_t h=Bucket(hash,OLD_TABLE_SIZE);
+        const Entry *found=find_in(old_mapa[h],key,hash);
+        if(found)
+        {
+            position=h;
+            v=found-old_mapa[h].data();
+            return true;
+        }
+    }
+    size_t h=Bucket(hash,TABLE_SIZE);
+    const Entry *found=find_in(mapa[h],key,hash);
+    if(found==nullptr) return false;
+    position=OLD_TABLE_SIZE+h;
+    v=found-mapa[h].data();
+    return true;
+  }
+
+  template <typename K>
+  bool remove_from(std::vector<Entry> &bucket, const K& key, size_t hash)
+  {
+    for(size_t i=0;i<bucket.size();++i)
+        if(bucket[i].hash==hash && StoredEqual::get()(bucket[i].data.first,key))
+        {
+            erase_at(bucket,i);
+            --Size;
+            return true;
+        }
+    return false;
+  }
+
+  // buckets are unordered, so the last entry is moved into the hole instead of shifting the tail;
+  // the key is const, hence destroy and rebuild in place rather than assignment
+  static void erase_at(std::vector<Entry> &bucket, size_t i)
+  {
+    if(i+1<bucket.size())
+    {
+        Entry *hole=&bucket[i];
+        hole->~Entry();
+        ::new(static_cast<void*>(hole)) Entry(std::move(bucket.back()));
+    }
+    bucket.pop_back();
+  }
+
+  // called before every new element; spreads moving the old table over the following inserts
+  void grow_if_needed()
+  {
+    if(mapa==nullptr)
+    {
+        enter_small_mode();
+        return;
+    }
+    if(old_mapa) rehash_step(REHASH_STEP);
+    if(full())
+    {
+        complete_rehash();
+        start_rehash(grown_size());
+        rehash_step(REHASH_STEP);
+    }
+  }
+
+  bool is_small() const
+  {
+    return mapa==&single_bucket;
+  }
+
+  // reserved up front: growing the bucket would copy the entries, the key being const
+  void enter_small_mode()
+  {
+    single_bucket.reserve(SMALL_LIMIT);
+    mapa=&single_bucket;
+    occupied=&small_bits;
+    TABLE_SIZE=1;
+    small_bits=0;
+    first_used=single_bucket.empty() ? 1 : 0;
+    end_used=single_bucket.empty() ? 0 : 1;
+  }
+
+  // one more element would be too many for the current table
+  bool full() const
+  {
+    if(is_small()) return Size+1>SMALL_LIMIT;
+    return Size+1>max_load*TABLE_SIZE;
+  }
+
+  size_t grown_size() const
+  {
+    return is_small() ? MIN_TABLE_SIZE : TABLE_SIZE*2;
+  }
+
+  void free_tables()
+  {
+    if(!is_small())
+    {
+        delete[] mapa;
+        delete[] occupied;
+    }
+    delete[] old_mapa;
+    std::vector<Entry>().swap(single_bucket);
+  }
+
+  void start_rehash(size_t new_size)
+  {
+    bool was_small=is_small();
+    if(!was_small) delete[] occupied;
+    old_mapa=mapa;
+    OLD_TABLE_SIZE=TABLE_SIZE;
+    migrated=0;
+    mapa=new std::vector<Entry>[new_size];
+    TABLE_SIZE=new_size;
+    occupied=new std::uint64_t[words(TABLE_SIZE)]();
+    first_used=TABLE_SIZE;
+    end_used=0;
+    if(was_small)
+    {
+        // a handful of entries, moved at once so old_mapa only ever holds an allocated table
+        old_mapa=nullptr;
+        OLD_TABLE_SIZE=0;
+        for(auto it=single_bucket.begin();it!=single_bucket.end();++it)
+        {
+            size_t h=Bucket(it->hash,TABLE_SIZE);
+            mapa[h].push_back(std::move(*it));
+            mark_used(h);
+        }
+        std::vector<Entry>().swap(single_bucket);
+        small_bits=0;
+    }
+  }
+
+  void rehash_step(size_t buckets)
+  {
+    size_t stop=migrated+buckets;
+    if(stop>OLD_TABLE_SIZE) stop=OLD_TABLE_SIZE;
+    for(;migrated<stop;++migrated)
+    {
+        std::vector<Entry> &bucket=old_mapa[migrated];
+        for(auto it=bucket.begin();it!=bucket.end();++it)
+        {
+            size_t h=Bucket(it->hash,TABLE_SIZE);
+            mapa[h].push_back(std::move(*it));
+            mark_used(h);
+        }
+        std::vector<Entry>().swap(bucket);
+    }
+    if(migrated==OLD_TABLE_SIZE)
+    {
+        delete[] old_mapa;
+        old_mapa=nullptr;
+        OLD_TABLE_SIZE=0;
+        migrated=0;
+    }
+  }
+
+  // moves whatever is left of the old table at once, for rehash() and the partitioned insertRange()
+  void complete_rehash()
+  {
+    if(old_mapa) rehash_step(OLD_TABLE_SIZE);
+  }
 };
 
-template <typename KeyType, typename ValueType>
-class HashMap<KeyType, ValueType>::ConstIterator
+template <typename KeyType, typename ValueType, typename Hasher, typename KeyEqual>
+class HashMap<KeyType, ValueType, Hasher, KeyEqual>::ConstIterator
 {
 public:
   using reference = typename HashMap::const_reference;
@@ -283,45 +1238,30 @@ public:
   using pointer = const typename HashMap::value_type*;
 
 private:
-  const std::vector<value_type> *mapa;
-  size_t hash_index;
+  const HashMap *map;
+  size_t hash_index; //bucket position, see HashMap::bucket_at()
   size_t vec_index;
 
-  size_t TABLE_SIZE=16384;
-
-  friend void HashMap<KeyType, ValueType>::remove(const const_iterator&);
+  friend class HashMap<KeyType, ValueType, Hasher, KeyEqual>;
 
 public:
-  explicit ConstIterator(const std::vector<value_type> *m=nullptr, size_t h=0, size_t v=0, size_t t=16384) : mapa(m), hash_index(h), vec_index(v), TABLE_SIZE(t) {}
+  explicit ConstIterator(const HashMap *m=nullptr, size_t h=0, size_t v=0) : map(m), hash_index(h), vec_index(v) {}
+
+  ConstIterator(const ConstIterator& other) : ConstIterator(other.map,other.hash_index,other.vec_index) {}
 
-  ConstIterator(const ConstIterator& other) : ConstIterator(other.mapa,other.hash_index,other.vec_index) {}
+  ConstIterator& operator=(const ConstIterator& other) = default;
 
   ConstIterator& operator++()
   {
-    if(mapa[hash_index].size()==0)
+    if(map==nullptr || map->Size==0 || hash_index>=map->end_position())
         throw std::out_of_range("++");
-    if(mapa[hash_index].size()-1>vec_index)
+    if(map->bucket_at(hash_index).size()-1>vec_index)
     {
         vec_index++;
         return *this;
     }
-    size_t current=hash_index;
-    do
-    {
-        ++current;
-    }
-    while(current<TABLE_SIZE-1 && mapa[current].size()==0);
-
-    if(current==TABLE_SIZE-1)
-    {
-        ++hash_index;
-        vec_index=0;
-    }
-    else
-    {
-        hash_index=current;
-        vec_index=0;
-    }
+    hash_index=map->position_from(hash_index+1);
+    vec_index=0;
     return *this;
   }
 
@@ -334,7 +1274,7 @@ public:
 
   ConstIterator& operator--()
   {
-    if(hash_index==0 && mapa[hash_index].size()==0)
+    if(map==nullptr)
         throw std::out_of_range("--");
 
     if(vec_index>0)
@@ -342,17 +1282,11 @@ public:
         --vec_index;
         return *this;
     }
-    size_t current=hash_index;
-    do
-    {
-        --current;
-    }
-    while(current>=0 && mapa[current].size()==0);
-
-    if(current<0)
+    size_t prev=hash_index;
+    if(!map->position_before(prev))
         throw std::out_of_range("--");
-    hash_index=current;
-    vec_index=mapa[hash_index].size()-1;
+    hash_index=prev;
+    vec_index=map->bucket_at(hash_index).size()-1;
 
     return *this;
   }
@@ -366,9 +1300,9 @@ public:
 
   reference operator*() const
   {
-    if(vec_index>=mapa[hash_index].size())
+    if(map==nullptr || hash_index>=map->end_position() || vec_index>=map->bucket_at(hash_index).size())
         throw std::out_of_range("*");
-    return mapa[hash_index][vec_index];
+    return map->bucket_at(hash_index)[vec_index].data;
   }
 
   pointer operator->() const
@@ -378,7 +1312,7 @@ public:
 
   bool operator==(const ConstIterator& other) const
   {
-    return (mapa==other.mapa && hash_index==other.hash_index && vec_index==other.vec_index);
+    return (map==other.map && hash_index==other.hash_index && vec_index==other.vec_index);
   }
 
   bool operator!=(const ConstIterator& other) const
@@ -387,14 +1321,14 @@ public:
   }
 };
 
-template <typename KeyType, typename ValueType>
-class HashMap<KeyType, ValueType>::Iterator : public HashMap<KeyType, ValueType>::ConstIterator
+template <typename KeyType, typename ValueType, typename Hasher, typename KeyEqual>
+class HashMap<KeyType, ValueType, Hasher, KeyEqual>::Iterator : public HashMap<KeyType, ValueType, Hasher, KeyEqual>::ConstIterator
 {
 public:
   using reference = typename HashMap::reference;
   using pointer = typename HashMap::value_type*;
 
-  explicit Iterator(const std::vector<value_type> *m=nullptr, size_t h=0, size_t v=0, size_t t=16384) : ConstIterator(m,h,v,t) {}
+  explicit Iterator(const HashMap *m=nullptr, size_t h=0, size_t v=0) : ConstIterator(m,h,v) {}
 
   Iterator(const ConstIterator& other)
     : ConstIterator(other)
@@ -0,0 +1,171 @@
+#ifndef AISDI_MAPS_HASHING_H
+#define AISDI_MAPS_HASHING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace aisdi
+{
+
+// murmur3 finalizer: every input bit flips about half of the output bits
+inline std::uint64_t mix64(std::uint64_t h)
+{
+  h^=h>>33;
+  h*=0xff51afd7ed558ccdULL;
+  h^=h>>33;
+  h*=0xc4ceb9fe1a85ec53ULL;
+  h^=h>>33;
+  return h;
+}
+
+namespace hashing_detail
+{
+
+// 64x64->128 multiply folded back to 64 bits
+inline std::uint64_t mum(std::uint64_t a, std::uint64_t b)
+{
+  __uint128_t r=static_cast<__uint128_t>(a)*b;
+  return std::uint64_t(r)^std::uint64_t(r>>64);
+}
+
+inline std::uint64_t read64(const unsigned char *p)
+{
+  std::uint64_t v;
+  std::memcpy(&v,p,sizeof(v));
+  return v;
+}
+
+inline std::uint64_t read32(const unsigned char *p)
+{
+  std::uint32_t v;
+  std::memcpy(&v,p,sizeof(v));
+  return v;
+}
+
+}
+
+// wyhash style byte hash: 16 bytes per multiply, three independent lanes above 48 bytes,
+// short inputs are read as two overlapping words so there is no per byte loop
+inline std::uint64_t hashBytes(const void *data, std::size_t len, std::uint64_t seed=0)
+{
+  using namespace hashing_detail;
+  const std::uint64_t s0=0xa0761d6478bd642fULL, s1=0xe7037ed1a0b428dbULL,
+                      s2=0x8ebc6af09c88c6e3ULL, s3=0x589965cc75374cc3ULL;
+  const unsigned char *p=static_cast<const unsigned char*>(data);
+  std::uint64_t a, b;
+  seed^=mum(seed^s0,s1);
+  if(len<=16)
+  {
+    if(len>=4)
+    {
+      std::size_t middle=(len>>3)<<2;
+      a=(read32(p)<<32)|read32(p+middle);
+      b=(read32(p+len-4)<<32)|read32(p+len-4-middle);
+    }
+    else if(len>0)
+    {
+      a=(std::uint64_t(p[0])<<16)|(std::uint64_t(p[len>>1])<<8)|p[len-1];
+      b=0;
+    }
+    else a=b=0;
+  }
+  else
+  {
+    std::size_t i=len;
+    if(i>48)
+    {
+      std::uint64_t lane1=seed, lane2=seed;
+      do
+      {
+        seed=mum(read64(p)^s1,read64(p+8)^seed);
+        lane1=mum(read64(p+16)^s2,read64(p+24)^lane1);
+        lane2=mum(read64(p+32)^s3,read64(p+40)^lane2);
+        p+=48;
+        i-=48;
+      } while(i>48);
+      seed^=lane1^lane2;
+    }
+    while(i>16)
+    {
+      seed=mum(read64(p)^s1,read64(p+8)^seed);
+      p+=16;
+      i-=16;
+    }
+    a=read64(p+i-16);
+    b=read64(p+i-8);
+  }
+  __uint128_t r=static_cast<__uint128_t>(a^s1)*(b^seed);
+  return mum(std::uint64_t(r)^s0^len,std::uint64_t(r>>64)^s1);
+}
+
+// A hasher declaring is_avalanching promises well mixed bits, so the maps use its result as is;
+// any other hash, std::hash of an integer being the identity, is passed through mix64 first
+template <typename Hash, typename = void>
+struct is_avalanching : std::false_type
+{};
+
+template <typename Hash>
+struct is_avalanching<Hash, std::void_t<typename Hash::is_avalanching>> : std::true_type
+{};
+
+// std::hash, except for integers and enums, which are mixed, and std::string, whose hash is
+// hashBytes and transparent: a std::string_view or const char* is hashed as is, without building a string
+template <typename Key, typename = void>
+struct DefaultHash
+{
+  std::size_t operator()(const Key& key) const
+  {
+    return std::hash<Key>()(key);
+  }
+};
+
+template <typename Key>
+struct DefaultHash<Key, typename std::enable_if<std::is_integral<Key>::value || std::is_enum<Key>::value>::type>
+{
+  using is_avalanching = void;
+
+  std::size_t operator()(const Key& key) const
+  {
+    return mix64(static_cast<std::uint64_t>(key));
+  }
+};
+
+template <>
+struct DefaultHash<std::string>
+{
+  using is_transparent = void;
+  using is_avalanching = void;
+
+  std::size_t operator()(std::string_view key) const
+  {
+    return hashBytes(key.data(),key.size());
+  }
+};
+
+template <typename Key>
+struct DefaultEqual : std::equal_to<Key>
+{};
+
+template <>
+struct DefaultEqual<std::string> : std::equal_to<>
+{};
+
+// true when both the hash and the equality accept K in place of the key type
+template <typename Hash, typename Equal, typename K, typename = void>
+struct is_transparent_lookup : std::false_type
+{};
+
+template <typename Hash, typename Equal, typename K>
+struct is_transparent_lookup<Hash, Equal, K,
+  std::void_t<typename Hash::is_transparent, typename Equal::is_transparent>>
+  : std::bool_constant<std::is_invocable<const Hash&, const K&>::value>
+{};
+
+}
+
+#endif /* AISDI_MAPS_HASHING_H */
@@ -0,0 +1,329 @@
+#ifndef AISDI_MAPS_PARALLEL_H
+#define AISDI_MAPS_PARALLEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace aisdi
+{
+
+// Fork-join thread pool with work stealing. Every worker has its own deque of tasks: it pushes and
+// pops at the back, so it goes depth first through what it forked last, while idle workers steal
+// from the front, where the oldest and so the biggest pieces of work are. A worker waiting for a
+// task that was stolen from it steals in the meantime instead of blocking.
+class ThreadPool
+{
+public:
+  explicit ThreadPool(unsigned count=std::thread::hardware_concurrency())
+    : workers(count ? count : 1), pending(0), sleeping(0), next_queue(0), stopping(false)
+  {
+    threads.reserve(workers.size());
+    for(size_t i=0;i<workers.size();++i)
+        threads.emplace_back(&ThreadPool::work,this,i);
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // waits for the queued work to finish
+  ~ThreadPool()
+  {
+    {
+        std::lock_guard<std::mutex> guard(idle_lock);
+        stopping.store(true);
+    }
+    idle.notify_all();
+    for(auto it=threads.begin();it!=threads.end();++it)
+        it->join();
+  }
+
+  unsigned size() const
+  {
+    return unsigned(workers.size());
+  }
+
+  // runs f() on the pool and waits until it and everything it forked are done, rethrowing what it
+  // threw; called from one of the pool's own tasks it just calls f()
+  template <typename F>
+  void run(F&& f)
+  {
+    if(current_pool()==this)
+    {
+        f();
+        return;
+    }
+    RootTask<F> task(f);
+    std::future<void> finished=task.promise.get_future();
+    push(next_queue++%workers.size(),&task);
+    finished.get();
+  }
+
+  // runs a() and b(), in parallel if a worker is free; b() is offered to the other workers while
+  // the calling one runs a(). Rethrows what either threw, after both are done
+  template <typename A, typename B>
+  void invoke(A&& a, B&& b)
+  {
+    if(current_pool()!=this)
+    {
+        run([&] { invoke(a,b); });
+        return;
+    }
+    size_t self=current_index();
+    ForkTask<B> forked(b);
+    push(self,&forked);
+    std::exception_ptr error;
+    try
+    {
+        a();
+    }
+    catch(...)
+    {
+        error=std::current_exception();
+    }
+    if(take_back(self,&forked))
+        forked.execute();
+    else
+        while(!forked.done.load(std::memory_order_acquire))
+        {
+            Task *task=steal(self);
+            if(task) task->execute();
+            else std::this_thread::yield();
+        }
+    if(error) std::rethrow_exception(error);
+    if(forked.error) std::rethrow_exception(forked.error);
+  }
+
+  // one worker per core, made on first use
+  static ThreadPool& shared()
+  {
+    static ThreadPool pool;
+    return pool;
+  }
+
+private:
+  struct Task
+  {
+    virtual void execute() = 0;
+
+  protected:
+    ~Task() {}
+  };
+
+  // a forked half; lives on the stack of the worker that forked it, which waits for done
+  template <typename F>
+  struct ForkTask : Task
+  {
+    F& f;
+    std::atomic<bool> done;
+    std::exception_ptr error;
+
+    explicit ForkTask(F& function) : f(function), done(false) {}
+
+    void execute() override
+    {
+        try
+        {
+            f();
+        }
+        catch(...)
+        {
+            error=std::current_exception();
+        }
+        done.store(true,std::memory_order_release);
+    }
+  };
+
+  // what run() queues from outside; the promise is the last thing it touches
+  template <typename F>
+  struct RootTask : Task
+  {
+    F& f;
+    std::promise<void> promise;
+
+    explicit RootTask(F& function) : f(function) {}
+
+    void execute() override
+    {
+        try
+        {
+            f();
+            promise.set_value();
+        }
+        catch(...)
+        {
+            promise.set_exception(std::current_exception());
+        }
+    }
+  };
+
+  struct alignas(64) Worker
+  {
+    std::mutex lock;
+    std::deque<Task*> tasks;
+  };
+
+  std::vector<Worker> workers;
+  std::vector<std::thread> threads;
+  std::atomic<size_t> pending; //tasks sitting in some deque
+  std::atomic<unsigned> sleeping;
+  std::atomic<size_t> next_queue; //where run() puts the next root task
+  std::mutex idle_lock;
+  std::condition_variable idle;
+  std::atomic<bool> stopping;
+
+  static ThreadPool*& current_pool()
+  {
+    static thread_local ThreadPool *pool=nullptr;
+    return pool;
+  }
+
+  static size_t& current_index()
+  {
+    static thread_local size_t index=0;
+    return index;
+  }
+
+  void push(size_t index, Task *task)
+  {
+    {
+        std::lock_guard<std::mutex> guard(workers[index].lock);
+        workers[index].tasks.push_back(task);
+    }
+    pending.fetch_add(1,std::memory_order_seq_cst);
+    if(sleeping.load(std::memory_order_seq_cst)!=0)
+    {
+        { std::lock_guard<std::mutex> guard(idle_lock); }
+        idle.notify_one();
+    }
+  }
+
+  // pops task off the back of worker index's deque unless it was stolen
+  bool take_back(size_t index, Task *task)
+  {
+    std::lock_guard<std::mutex> guard(workers[index].lock);
+    std::deque<Task*>& tasks=workers[index].tasks;
+    if(tasks.empty() || tasks.back()!=task) return false;
+    tasks.pop_back();
+    pending.fetch_sub(1,std::memory_order_relaxed);
+    return true;
+  }
+
+  Task* pop(size_t index)
+  {
+    std::lock_guard<std::mutex> guard(workers[index].lock);
+    std::deque<Task*>& tasks=workers[index].tasks;
+    if(tasks.empty()) return nullptr;
+    Task *task=tasks.back();
+    tasks.pop_back();
+    pending.fetch_sub(1,std::memory_order_relaxed);
+    return task;
+  }
+
+  // the oldest task of the first other worker that has one
+  Task* steal(size_t thief)
+  {
+    for(size_t i=1;i<workers.size();++i)
+    {
+        Worker& victim=workers[(thief+i)%workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if(victim.tasks.empty()) continue;
+        Task *task=victim.tasks.front();
+        victim.tasks.pop_front();
+        pending.fetch_sub(1,std::memory_order_relaxed);
+        return task;
+    }
+    return nullptr;
+  }
+
+  // a worker sleeps only after seeing no pending task with sleeping already raised, and push()
+  // raises pending before looking at sleeping, so one of the two always sees the other
+  void work(size_t index)
+  {
+    current_pool()=this;
+    current_index()=index;
+    for(;;)
+    {
+        Task *task=pop(index);
+        if(task==nullptr) task=steal(index);
+        if(task)
+        {
+            task->execute();
+            continue;
+        }
+        sleeping.fetch_add(1,std::memory_order_seq_cst);
+        {
+            std::unique_lock<std::mutex> guard(idle_lock);
+            idle.wait(guard,[this] { return pending.load(std::memory_order_seq_cst)!=0 || stopping; });
+        }
+        sleeping.fetch_sub(1,std::memory_order_relaxed);
+        if(stopping.load() && pending.load()==0) return;
+    }
+  }
+};
+
+namespace parallel_detail
+{
+
+template <typename Slice, typename Visitor>
+void for_each(ThreadPool& pool, const Slice& slice, Visitor& visit)
+{
+  if(!slice.divisible())
+  {
+    slice.forEach(visit);
+    return;
+  }
+  auto halves=slice.split();
+  pool.invoke([&] { for_each(pool,halves.first,visit); }, [&] { for_each(pool,halves.second,visit); });
+}
+
+template <typename T, typename Slice, typename Transform, typename Combine>
+T reduce(ThreadPool& pool, const Slice& slice, const T& identity, Transform& transform, Combine& combine)
+{
+  if(!slice.divisible())
+  {
+    T result=identity;
+    slice.forEach([&](const auto& element) { result=combine(std::move(result),transform(element)); });
+    return result;
+  }
+  auto halves=slice.split();
+  T left=identity, right=identity;
+  pool.invoke([&] { left=reduce(pool,halves.first,identity,transform,combine); },
+              [&] { right=reduce(pool,halves.second,identity,transform,combine); });
+  return combine(std::move(left),std::move(right));
+}
+
+}
+
+// calls visit(const value_type&) for every element of a HashMap or TreeMap, from several threads
+// at once, so visit must be safe to call concurrently; the map must not change meanwhile.
+// The map is split through its slice(): bucket runs for HashMap, rank ranges for TreeMap
+template <typename Map, typename Visitor>
+void parallelForEach(const Map& map, Visitor visit, ThreadPool& pool=ThreadPool::shared())
+{
+  auto slice=map.slice();
+  pool.run([&] { parallel_detail::for_each(pool,slice,visit); });
+}
+
+// combine(combine(identity, transform(e1)), transform(e2))... over all elements e, computed per
+// slice and the slices combined in iteration order; combine must be associative and identity
+// neutral for it, transform safe to call concurrently
+template <typename Map, typename T, typename Transform, typename Combine>
+T parallelReduce(const Map& map, T identity, Transform transform, Combine combine, ThreadPool& pool=ThreadPool::shared())
+{
+  auto slice=map.slice();
+  T result=identity;
+  pool.run([&] { result=parallel_detail::reduce(pool,slice,identity,transform,combine); });
+  return result;
+}
+
+}
+
+#endif /* AISDI_MAPS_PARALLEL_H */
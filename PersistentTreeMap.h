@@ -0,0 +1,578 @@
+#ifndef AISDI_MAPS_PERSISTENTTREEMAP_H
+#define AISDI_MAPS_PERSISTENTTREEMAP_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "StoredFunctor.h"
+
+namespace aisdi
+{
+
+// Ordered map whose versions share structure: an AVL tree of immutable, reference counted nodes.
+// A change copies only the nodes on the path to the key (and those a rotation touches) and
+// shares every other subtree with the version before it, so copying a map, or snapshot(),
+// just shares the root, O(1). A node goes when the last version holding it does.
+// One map object is not thread safe, but the counts are atomic and nodes never change, so
+// different maps sharing nodes, such as a writer's map and snapshots handed to readers, can be
+// used from different threads at once without any locking.
+// The map keeps its own Compare, like TreeMap, and hands it on to its copies and snapshots.
+template <typename KeyType, typename ValueType, typename Compare = std::less<KeyType>>
+class PersistentTreeMap : private StoredFunctor<Compare, 0>
+{
+public:
+  using key_type = KeyType;
+  using mapped_type = ValueType;
+  using key_compare = Compare;
+  using value_type = std::pair<const key_type, mapped_type>;
+  using size_type = std::size_t;
+  using const_reference = const value_type&;
+
+  class ConstIterator;
+  using const_iterator = ConstIterator;
+  using iterator = ConstIterator; //nodes are shared, so elements are never changed in place
+
+private:
+    using StoredCompare = StoredFunctor<key_compare, 0>;
+
+    struct Node
+    {
+        value_type data;
+        const Node *left;
+        const Node *right;
+        int height; //of the subtree, a leaf is 1
+        mutable std::atomic<size_type> refs; //versions and parent nodes pointing here
+
+        template <typename... Args>
+        explicit Node(Args&&... args) : data(std::forward<Args>(args)...), left(nullptr), right(nullptr), height(1), refs(1) {}
+    };
+
+    // one owned reference, given up by take() or released when it goes out of scope,
+    // so a half built path is freed if constructing a node throws
+    class Ref
+    {
+        const Node *node;
+
+    public:
+        explicit Ref(const Node *n=nullptr) : node(n) {}
+
+        Ref(Ref&& other) : node(other.take()) {}
+
+        Ref(const Ref&) = delete;
+        Ref& operator=(const Ref&) = delete;
+
+        ~Ref()
+        {
+            release(node);
+        }
+
+        const Node* get() const
+        {
+            return node;
+        }
+
+        const Node* operator->() const
+        {
+            return node;
+        }
+
+        const Node* take()
+        {
+            const Node *n=node;
+            node=nullptr;
+            return n;
+        }
+    };
+
+  const Node *root;
+  size_type Size;
+
+public:
+  PersistentTreeMap() : root(nullptr), Size(0) {}
+
+  explicit PersistentTreeMap(const key_compare& compare) : StoredCompare(compare), root(nullptr), Size(0) {}
+
+  PersistentTreeMap(std::initializer_list<value_type> list, const key_compare& compare=key_compare())
+    : PersistentTreeMap(compare)
+  {
+    for(auto it=list.begin();it!=list.end();++it)
+        insert_or_assign(it->first,it->second);
+  }
+
+  // shares every node, O(1)
+  PersistentTreeMap(const PersistentTreeMap& other)
+    : StoredCompare(other), root(retain(other.root).take()), Size(other.Size) {}
+
+  PersistentTreeMap(PersistentTreeMap&& other) : StoredCompare(other), root(other.root), Size(other.Size)
+  {
+    other.root=nullptr;
+    other.Size=0;
+  }
+
+  ~PersistentTreeMap()
+  {
+    release(root);
+  }
+
+  PersistentTreeMap& operator=(const PersistentTreeMap& other)
+  {
+    if(this==&other) return *this;
+
+    PersistentTreeMap copy(other);
+    return *this=std::move(copy);
+  }
+
+  PersistentTreeMap& operator=(PersistentTreeMap&& other)
+  {
+    if(this==&other) return *this;
+
+    StoredCompare::operator=(other);
+    release(root);
+    root=other.root;
+    Size=other.Size;
+    other.root=nullptr;
+    other.Size=0;
+    return *this;
+  }
+
+  // the current version, O(1); later changes to this map do not show in it and the other way round
+  PersistentTreeMap snapshot() const
+  {
+    return *this;
+  }
+
+  key_compare key_comp() const
+  {
+    return StoredCompare::get();
+  }
+
+  bool isEmpty() const
+  {
+    return !Size;
+  }
+
+  size_type getSize() const
+  {
+    return Size;
+  }
+
+  // inserts, or assigns to the value already there; true if the key was new
+  template <typename M>
+  bool insert_or_assign(const key_type& key, M&& value)
+  {
+    bool added=false;
+    Ref changed=assign(root,key,std::forward<M>(value),added);
+    release(root);
+    root=changed.take();
+    if(added) ++Size;
+    return added;
+  }
+
+  // inserts only if the key is absent, returns true if it did
+  template <typename M>
+  bool insert(const key_type& key, M&& value)
+  {
+    if(find_node(key)!=nullptr) return false;
+    return insert_or_assign(key,std::forward<M>(value));
+  }
+
+  // returns how many elements went (0 or 1)
+  size_type erase(const key_type& key)
+  {
+    if(find_node(key)==nullptr) return 0;
+    Ref changed=erase_key(root,key);
+    release(root);
+    root=changed.take();
+    --Size;
+    return 1;
+  }
+
+  void remove(const key_type& key)
+  {
+    if(erase(key)==0)
+        throw std::out_of_range("remove");
+  }
+
+  // the reference stays valid while any version holding the element is alive
+  const mapped_type& valueOf(const key_type& key) const
+  {
+    const Node *node=find_node(key);
+    if(node==nullptr)
+        throw std::out_of_range("valueOf");
+    return node->data.second;
+  }
+
+  const mapped_type* tryGet(const key_type& key) const
+  {
+    const Node *node=find_node(key);
+    return node ? &node->data.second : nullptr;
+  }
+
+  bool contains(const key_type& key) const
+  {
+    return find_node(key)!=nullptr;
+  }
+
+  // calls visit on every element with from <= key < to in key order, returns how many were visited
+  template <typename Visitor>
+  size_type forEachInRange(const key_type& from, const key_type& to, Visitor visit) const
+  {
+    if(!Less(from,to)) return 0;
+    return visit_range(root,from,to,visit);
+  }
+
+  // O(1) when both share the root, as a map and an untouched snapshot of it do
+  bool operator==(const PersistentTreeMap& other) const
+  {
+    if(Size!=other.Size) return false;
+    if(root==other.root) return true;
+    for(auto it=begin(),ito=other.begin();it!=end();++it,++ito)
+        if(*it!=*ito) return false;
+    return true;
+  }
+
+  bool operator!=(const PersistentTreeMap& other) const
+  {
+    return !(*this == other);
+  }
+
+  // iterators walk the version they were made from and stay valid while a map holding it is alive
+  const_iterator find(const key_type& key) const
+  {
+    ConstIterator it(root);
+    for(const Node *node=root;node!=nullptr;)
+    {
+        it.path.push_back(node);
+        if(Less(key,node->data.first)) node=node->left;
+        else if(Less(node->data.first,key)) node=node->right;
+        else return it;
+    }
+    return end();
+  }
+
+  // first element whose key is not less than key
+  const_iterator lower_bound(const key_type& key) const
+  {
+    return bound(key,false);
+  }
+
+  // first element whose key is greater than key
+  const_iterator upper_bound(const key_type& key) const
+  {
+    return bound(key,true);
+  }
+
+  const_iterator cbegin() const
+  {
+    ConstIterator it(root);
+    it.push_leftmost(root);
+    return it;
+  }
+
+  const_iterator cend() const
+  {
+    return ConstIterator(root);
+  }
+
+  const_iterator begin() const
+  {
+    return cbegin();
+  }
+
+  const_iterator end() const
+  {
+    return cend();
+  }
+
+private:
+
+  bool Less(const key_type& a, const key_type& b) const
+  {
+      return StoredCompare::get()(a,b);
+  }
+
+  static Ref retain(const Node *node)
+  {
+    if(node) node->refs.fetch_add(1,std::memory_order_relaxed);
+    return Ref(node);
+  }
+
+  // the last reference frees the node and lets go of its children, so a dropped version frees
+  // exactly the nodes no other version shares; the recursion is as deep as the tree is high
+  static void release(const Node *node)
+  {
+    if(node==nullptr || node->refs.fetch_sub(1,std::memory_order_acq_rel)!=1) return;
+    release(node->left);
+    release(node->right);
+    delete node;
+  }
+
+  static int height(const Node *node)
+  {
+    return node ? node->height : 0;
+  }
+
+  // a new node built from args with the given children
+  template <typename... Args>
+  static Ref make(Ref left, Ref right, Args&&... args)
+  {
+    Node *node=new Node(std::forward<Args>(args)...);
+    node->height=(height(left.get())>height(right.get()) ? height(left.get()) : height(right.get()))+1;
+    node->left=left.take();
+    node->right=right.take();
+    return Ref(node);
+  }
+
+  // a copy of data with children left and right, which differ in height by at most 2;
+  // rebalanced by a single or double rotation, building new nodes for the rotated ones
+  static Ref join(const value_type& data, Ref left, Ref right)
+  {
+    int difference=height(left.get())-height(right.get());
+    if(difference>1)
+    {
+        if(height(left->left)>=height(left->right))
+        {
+            Ref lower=make(retain(left->right),std::move(right),data);
+            return make(retain(left->left),std::move(lower),left->data);
+        }
+        const Node *middle=left->right;
+        Ref lower_left=make(retain(left->left),retain(middle->left),left->data);
+        Ref lower_right=make(retain(middle->right),std::move(right),data);
+        return make(std::move(lower_left),std::move(lower_right),middle->data);
+    }
+    if(difference<-1)
+    {
+        if(height(right->right)>=height(right->left))
+        {
+            Ref lower=make(std::move(left),retain(right->left),data);
+            return make(std::move(lower),retain(right->right),right->data);
+        }
+        const Node *middle=right->left;
+        Ref lower_left=make(std::move(left),retain(middle->left),data);
+        Ref lower_right=make(retain(middle->right),retain(right->right),right->data);
+        return make(std::move(lower_left),std::move(lower_right),middle->data);
+    }
+    return make(std::move(left),std::move(right),data);
+  }
+
+  // node's subtree with key set to value, as a new path down to key
+  template <typename M>
+  Ref assign(const Node *node, const key_type& key, M&& value, bool& added) const
+  {
+    if(node==nullptr)
+    {
+        added=true;
+        return make(Ref(),Ref(),key,std::forward<M>(value));
+    }
+    if(Less(key,node->data.first))
+    {
+        Ref left=assign(node->left,key,std::forward<M>(value),added);
+        return join(node->data,std::move(left),retain(node->right));
+    }
+    if(Less(node->data.first,key))
+    {
+        Ref right=assign(node->right,key,std::forward<M>(value),added);
+        return join(node->data,retain(node->left),std::move(right));
+    }
+    return make(retain(node->left),retain(node->right),node->data.first,std::forward<M>(value));
+  }
+
+  // node's subtree without key, which must be in it
+  Ref erase_key(const Node *node, const key_type& key) const
+  {
+    if(Less(key,node->data.first))
+    {
+        Ref left=erase_key(node->left,key);
+        return join(node->data,std::move(left),retain(node->right));
+    }
+    if(Less(node->data.first,key))
+    {
+        Ref right=erase_key(node->right,key);
+        return join(node->data,retain(node->left),std::move(right));
+    }
+    if(node->left==nullptr) return retain(node->right);
+    if(node->right==nullptr) return retain(node->left);
+    const Node *successor=node->right;
+    while(successor->left!=nullptr) successor=successor->left;
+    Ref right=erase_minimum(node->right);
+    return join(successor->data,retain(node->left),std::move(right));
+  }
+
+  static Ref erase_minimum(const Node *node)
+  {
+    if(node->left==nullptr) return retain(node->right);
+    Ref left=erase_minimum(node->left);
+    return join(node->data,std::move(left),retain(node->right));
+  }
+
+  const Node* find_node(const key_type& key) const
+  {
+    const Node *node=root;
+    while(node!=nullptr)
+    {
+        if(Less(key,node->data.first)) node=node->left;
+        else if(Less(node->data.first,key)) node=node->right;
+        else return node;
+    }
+    return nullptr;
+  }
+
+  // the answer is the last node where the descent went left; the path is cut back to it
+  const_iterator bound(const key_type& key, bool upper) const
+  {
+    ConstIterator it(root);
+    size_type answer=0; //path length up to and including the answer, 0 for none
+    for(const Node *node=root;node!=nullptr;)
+    {
+        it.path.push_back(node);
+        if(upper ? Less(key,node->data.first) : !Less(node->data.first,key))
+        {
+            answer=it.path.size();
+            node=node->left;
+        }
+        else node=node->right;
+    }
+    it.path.resize(answer);
+    return it;
+  }
+
+  template <typename Visitor>
+  size_type visit_range(const Node *node, const key_type& from, const key_type& to, Visitor& visit) const
+  {
+    if(node==nullptr) return 0;
+    size_type visited=0;
+    bool above_from=!Less(node->data.first,from);
+    bool below_to=Less(node->data.first,to);
+    if(above_from) visited+=visit_range(node->left,from,to,visit);
+    if(above_from && below_to)
+    {
+        visit(node->data);
+        ++visited;
+    }
+    if(below_to) visited+=visit_range(node->right,from,to,visit);
+    return visited;
+  }
+};
+
+// nodes have no parent pointers, as a node can sit in many versions, so the iterator keeps the
+// path from the root to its element; the end iterator has an empty path
+template <typename KeyType, typename ValueType, typename Compare>
+class PersistentTreeMap<KeyType, ValueType, Compare>::ConstIterator
+{
+public:
+  using reference = typename PersistentTreeMap::const_reference;
+  using iterator_category = std::bidirectional_iterator_tag;
+  using value_type = typename PersistentTreeMap::value_type;
+  using pointer = const typename PersistentTreeMap::value_type*;
+  using difference_type = std::ptrdiff_t;
+
+  explicit ConstIterator(const Node *r=nullptr) : root(r) {}
+
+  ConstIterator& operator++()
+  {
+    if(path.empty())
+        throw std::out_of_range("++");
+    const Node *node=path.back();
+    if(node->right!=nullptr)
+    {
+        push_leftmost(node->right);
+        return *this;
+    }
+    path.pop_back();
+    while(!path.empty() && path.back()->right==node)
+    {
+        node=path.back();
+        path.pop_back();
+    }
+    return *this;
+  }
+
+  ConstIterator operator++(int)
+  {
+    ConstIterator temp=*this;
+    operator++();
+    return temp;
+  }
+
+  ConstIterator& operator--()
+  {
+    std::vector<const Node*> previous=path;
+    if(previous.empty())
+    {
+        for(const Node *node=root;node!=nullptr;node=node->right)
+            previous.push_back(node);
+    }
+    else if(previous.back()->left!=nullptr)
+    {
+        for(const Node *node=previous.back()->left;node!=nullptr;node=node->right)
+            previous.push_back(node);
+    }
+    else
+    {
+        const Node *node=previous.back();
+        previous.pop_back();
+        while(!previous.empty() && previous.back()->left==node)
+        {
+            node=previous.back();
+            previous.pop_back();
+        }
+    }
+    if(previous.empty())
+        throw std::out_of_range("--");
+    path.swap(previous);
+    return *this;
+  }
+
+  ConstIterator operator--(int)
+  {
+    ConstIterator temp=*this;
+    operator--();
+    return temp;
+  }
+
+  reference operator*() const
+  {
+    if(path.empty())
+        throw std::out_of_range("*");
+    return path.back()->data;
+  }
+
+  pointer operator->() const
+  {
+    return &this->operator*();
+  }
+
+  bool operator==(const ConstIterator& other) const
+  {
+    const Node *mine= path.empty() ? nullptr : path.back();
+    const Node *theirs= other.path.empty() ? nullptr : other.path.back();
+    return root==other.root && mine==theirs;
+  }
+
+  bool operator!=(const ConstIterator& other) const
+  {
+    return !(*this == other);
+  }
+
+private:
+  friend class PersistentTreeMap;
+
+  const Node *root;
+  std::vector<const Node*> path;
+
+  void push_leftmost(const Node *node)
+  {
+    for(;node!=nullptr;node=node->left)
+        path.push_back(node);
+  }
+};
+
+}
+
+#endif /* AISDI_MAPS_PERSISTENTTREEMAP_H */
@@ -0,0 +1,725 @@
+#ifndef AISDI_MAPS_SNAPSHOT_H
+#define AISDI_MAPS_SNAPSHOT_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "HashMap.h"
+#include "TreeMap.h"
+
+namespace aisdi
+{
+
+// Binary snapshots of maps with trivially copyable keys and values.
+//
+// A file is a 64 byte SnapshotHeader followed by the payload, in the byte order of the machine
+// that wrote it (files from the other byte order are rejected):
+//   sorted layout (TreeMap):  count entries in increasing key order
+//   hashed layout (HashMap):  slots 64 bit tags, 0 for an empty slot, then slots entries;
+//                             linear probing from snapshotHash(key) & (slots-1)
+// An entry is a SnapshotEntry, padding included, so the mapped pages are used as they are.
+// The checksum covers everything after the header.
+
+const std::uint32_t SNAPSHOT_VERSION=1;
+
+enum class SnapshotLayout : std::uint32_t
+{
+  Sorted=1,
+  Hashed=2
+};
+
+struct SnapshotHeader
+{
+  char magic[8];
+  std::uint32_t byte_order; //0x01020304 as written
+  std::uint32_t version;
+  std::uint32_t layout;
+  std::uint32_t key_size;
+  std::uint32_t value_size;
+  std::uint32_t entry_size;
+  std::uint64_t count;
+  std::uint64_t slots; //hashed layout only
+  std::uint64_t checksum;
+  std::uint64_t payload_size;
+};
+
+static_assert(sizeof(SnapshotHeader)==64, "SnapshotHeader must stay 64 bytes");
+
+template <typename KeyType, typename ValueType>
+struct SnapshotEntry
+{
+  KeyType first;
+  ValueType second;
+
+  static_assert(std::is_trivially_copyable<KeyType>::value && std::is_trivially_copyable<ValueType>::value,
+                "snapshots hold trivially copyable keys and values only");
+};
+
+// word at a time multiply-xorshift over a byte stream, fed in pieces of any length
+class SnapshotChecksum
+{
+public:
+  SnapshotChecksum() : state(0x243F6A8885A308D3ULL), length(0), pending_bytes(0) {}
+
+  void update(const void *data, std::size_t n)
+  {
+    const unsigned char *p=static_cast<const unsigned char*>(data);
+    length+=n;
+    if(pending_bytes>0)
+    {
+        while(n>0 && pending_bytes<8)
+        {
+            pending[pending_bytes++]=*p++;
+            --n;
+        }
+        if(pending_bytes<8) return;
+        add(pending);
+        pending_bytes=0;
+    }
+    for(;n>=8;n-=8,p+=8)
+        add(p);
+    while(n>0)
+    {
+        pending[pending_bytes++]=*p++;
+        --n;
+    }
+  }
+
+  std::uint64_t finish() const
+  {
+    std::uint64_t h=state;
+    if(pending_bytes)
+    {
+        unsigned char last[8]={};
+        std::memcpy(last,pending,pending_bytes);
+        std::uint64_t word;
+        std::memcpy(&word,last,8);
+        h=step(h,word);
+    }
+    return mix(h^length);
+  }
+
+  static std::uint64_t of(const void *data, std::size_t n)
+  {
+    SnapshotChecksum checksum;
+    checksum.update(data,n);
+    return checksum.finish();
+  }
+
+private:
+  std::uint64_t state;
+  std::uint64_t length;
+  unsigned char pending[8]; //an unfinished word
+  unsigned pending_bytes;
+
+  void add(const unsigned char *bytes)
+  {
+    std::uint64_t word;
+    std::memcpy(&word,bytes,8);
+    state=step(state,word);
+  }
+
+  static std::uint64_t step(std::uint64_t h, std::uint64_t word)
+  {
+    h^=word*0x9E3779B97F4A7C15ULL;
+    h=(h<<31)|(h>>33);
+    return h*0xbf58476d1ce4e5b9ULL;
+  }
+
+  static std::uint64_t mix(std::uint64_t h)
+  {
+    h^=h>>33;
+    h*=0xff51afd7ed558ccdULL;
+    h^=h>>33;
+    h*=0xc4ceb9fe1a85ec53ULL;
+    h^=h>>33;
+    return h;
+  }
+};
+
+// hash of the key's bytes: unlike std::hash it is the same in every build, as a stored table needs;
+// equal keys must have equal bytes, hence the unique representation requirement
+template <typename KeyType>
+inline std::uint64_t snapshotHash(const KeyType& key)
+{
+  static_assert(std::has_unique_object_representations<KeyType>::value,
+                "hashed snapshots need keys whose equal values have equal bytes");
+  return SnapshotChecksum::of(&key,sizeof(key));
+}
+
+// a whole file mapped read-only
+class MappedFile
+{
+public:
+  explicit MappedFile(const std::string& path) : address(nullptr), length(0)
+  {
+    int fd=::open(path.c_str(),O_RDONLY);
+    if(fd<0)
+        throw std::system_error(errno,std::generic_category(),"open "+path);
+    struct stat info;
+    if(::fstat(fd,&info)<0)
+    {
+        int error=errno;
+        ::close(fd);
+        throw std::system_error(error,std::generic_category(),"stat "+path);
+    }
+    length=std::size_t(info.st_size);
+    if(length>0)
+    {
+        address=::mmap(nullptr,length,PROT_READ,MAP_PRIVATE,fd,0);
+        if(address==MAP_FAILED)
+        {
+            int error=errno;
+            ::close(fd);
+            address=nullptr;
+            throw std::system_error(error,std::generic_category(),"mmap "+path);
+        }
+    }
+    ::close(fd);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  MappedFile(MappedFile&& other) : address(other.address), length(other.length)
+  {
+    other.address=nullptr;
+    other.length=0;
+  }
+
+  ~MappedFile()
+  {
+    if(address) ::munmap(address,length);
+  }
+
+  const unsigned char* data() const
+  {
+    return static_cast<const unsigned char*>(address);
+  }
+
+  std::size_t size() const
+  {
+    return length;
+  }
+
+private:
+  void *address;
+  std::size_t length;
+};
+
+namespace snapshot
+{
+
+inline std::size_t align_up(std::size_t offset, std::size_t alignment)
+{
+  return (offset+alignment-1)/alignment*alignment;
+}
+
+template <typename Entry>
+inline std::size_t entries_offset(SnapshotLayout layout, std::uint64_t slots)
+{
+  static_assert(alignof(Entry)<=sizeof(SnapshotHeader), "entry alignment beyond the header size");
+  std::size_t offset=sizeof(SnapshotHeader);
+  if(layout==SnapshotLayout::Hashed) offset+=slots*sizeof(std::uint64_t);
+  return align_up(offset,alignof(Entry));
+}
+
+// where the entries of a file with these header fields end, false if that overflows a size_t
+template <typename Entry>
+inline bool entries_end(SnapshotLayout layout, std::uint64_t slots, std::uint64_t entries, std::size_t& end)
+{
+  std::size_t offset=sizeof(SnapshotHeader);
+  std::size_t tags=0;
+  if(layout==SnapshotLayout::Hashed && (__builtin_mul_overflow(slots,sizeof(std::uint64_t),&tags)
+                                        || __builtin_add_overflow(offset,tags,&offset)))
+      return false;
+  if(__builtin_add_overflow(offset,alignof(Entry)-1,&offset))
+      return false;
+  offset=offset/alignof(Entry)*alignof(Entry);
+  std::size_t bytes;
+  return !__builtin_mul_overflow(entries,sizeof(Entry),&bytes) && !__builtin_add_overflow(offset,bytes,&end);
+}
+
+// flushes a file, or a directory entry, to the disk
+inline void sync_path(const std::string& path, int flags)
+{
+  int fd=::open(path.c_str(),flags);
+  if(fd<0)
+      throw std::system_error(errno,std::generic_category(),"open "+path);
+  if(::fsync(fd)<0)
+  {
+      int error=errno;
+      ::close(fd);
+      throw std::system_error(error,std::generic_category(),"fsync "+path);
+  }
+  ::close(fd);
+}
+
+template <typename Entry>
+inline SnapshotHeader make_header(SnapshotLayout layout, std::uint64_t count, std::uint64_t slots)
+{
+  SnapshotHeader header;
+  std::memset(&header,0,sizeof(header));
+  std::memcpy(header.magic,"AISDIMAP",8);
+  header.byte_order=0x01020304;
+  header.version=SNAPSHOT_VERSION;
+  header.layout=std::uint32_t(layout);
+  header.key_size=sizeof(Entry::first);
+  header.value_size=sizeof(Entry::second);
+  header.entry_size=sizeof(Entry);
+  header.count=count;
+  header.slots=slots;
+  return header;
+}
+
+// entries are assembled in zeroed memory, so padding is written as zeros and the checksum is stable
+template <typename Entry, typename Key, typename Value>
+inline void put_entry(unsigned char *place, const Key& key, const Value& value)
+{
+  static_assert(std::is_standard_layout<Entry>::value, "snapshot entries need a standard layout");
+  std::memcpy(place+offsetof(Entry,first),&key,sizeof(Key));
+  std::memcpy(place+offsetof(Entry,second),&value,sizeof(Value));
+}
+
+// streams the payload to path+".tmp" and renames it over path once complete; the file is synced
+// before the rename and the directory after it, so a crash leaves the old snapshot or the new one
+class Writer
+{
+public:
+  Writer(const std::string& target, const SnapshotHeader& h) : path(target), temp(target+".tmp"), header(h),
+    out(temp,std::ios::binary | std::ios::trunc)
+  {
+    if(!out)
+        throw std::runtime_error("saveSnapshot: cannot create "+temp);
+    out.write(reinterpret_cast<const char*>(&header),sizeof(header));
+    written=sizeof(header);
+  }
+
+  Writer(const Writer&) = delete;
+  Writer& operator=(const Writer&) = delete;
+
+  ~Writer()
+  {
+    if(out.is_open())
+    {
+        out.close();
+        std::remove(temp.c_str());
+    }
+  }
+
+  void write(const void *data, std::size_t n)
+  {
+    out.write(static_cast<const char*>(data),n);
+    checksum.update(data,n);
+    written+=n;
+  }
+
+  void pad_to(std::size_t offset)
+  {
+    static const unsigned char zeros[64]={};
+    write(zeros,offset-written);
+  }
+
+  void commit()
+  {
+    header.checksum=checksum.finish();
+    header.payload_size=written-sizeof(header);
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header),sizeof(header));
+    out.close();
+    if(out.fail())
+    {
+        std::remove(temp.c_str());
+        throw std::runtime_error("saveSnapshot: cannot write "+temp);
+    }
+    try
+    {
+        sync_path(temp,O_RDONLY);
+    }
+    catch(...)
+    {
+        std::remove(temp.c_str());
+        throw;
+    }
+    if(std::rename(temp.c_str(),path.c_str())!=0)
+    {
+        int error=errno;
+        std::remove(temp.c_str());
+        throw std::system_error(error,std::generic_category(),"rename "+temp);
+    }
+    std::string::size_type slash=path.rfind('/');
+    sync_path(slash==std::string::npos ? "." : slash==0 ? "/" : path.substr(0,slash),O_RDONLY | O_DIRECTORY);
+  }
+
+private:
+  std::string path;
+  std::string temp;
+  SnapshotHeader header;
+  std::ofstream out;
+  SnapshotChecksum checksum;
+  std::size_t written;
+};
+
+// checks the header against the expected layout and entry type, and the checksum if asked to
+template <typename Entry>
+inline const SnapshotHeader& open_header(const MappedFile& file, SnapshotLayout layout, bool verify)
+{
+  if(file.size()<sizeof(SnapshotHeader))
+      throw std::runtime_error("snapshot: file too short");
+  const SnapshotHeader& header=*reinterpret_cast<const SnapshotHeader*>(file.data());
+  if(std::memcmp(header.magic,"AISDIMAP",8)!=0)
+      throw std::runtime_error("snapshot: not a snapshot file");
+  if(header.byte_order!=0x01020304)
+      throw std::runtime_error("snapshot: written with the other byte order");
+  if(header.version!=SNAPSHOT_VERSION)
+      throw std::runtime_error("snapshot: unsupported version "+std::to_string(header.version));
+  if(header.layout!=std::uint32_t(layout))
+      throw std::runtime_error("snapshot: wrong layout");
+  if(header.key_size!=sizeof(Entry::first) || header.value_size!=sizeof(Entry::second) || header.entry_size!=sizeof(Entry))
+      throw std::runtime_error("snapshot: key or value type does not match");
+  if(layout==SnapshotLayout::Hashed && (header.slots==0 || (header.slots & (header.slots-1)) || header.count>=header.slots))
+      throw std::runtime_error("snapshot: bad table size");
+  // the counts are bounded by the file before anything is multiplied by them
+  std::uint64_t entries= layout==SnapshotLayout::Hashed ? header.slots : header.count;
+  std::size_t payload=file.size()-sizeof(SnapshotHeader);
+  std::size_t expected;
+  if(entries>payload/sizeof(Entry) || !entries_end<Entry>(layout,header.slots,entries,expected)
+     || header.payload_size!=payload || file.size()!=expected)
+      throw std::runtime_error("snapshot: truncated or oversized file");
+  if(verify && SnapshotChecksum::of(file.data()+sizeof(SnapshotHeader),header.payload_size)!=header.checksum)
+      throw std::runtime_error("snapshot: checksum mismatch");
+  return header;
+}
+
+}
+
+// writes the map as a sorted array of entries; the file is in operator< order, so a map ordered
+// by another Compare is copied into that order first
+template <typename KeyType, typename ValueType, typename Compare>
+void saveSnapshot(const TreeMap<KeyType, ValueType, Compare>& map, const std::string& path)
+{
+  if constexpr(!orders_by_less<Compare, KeyType>::value)
+  {
+    saveSnapshot(TreeMap<KeyType, ValueType>(map.begin(),map.end()),path);
+    return;
+  }
+  using Entry = SnapshotEntry<KeyType, ValueType>;
+  const std::size_t CHUNK=4096;
+
+  snapshot::Writer writer(path,snapshot::make_header<Entry>(SnapshotLayout::Sorted,map.getSize(),0));
+  writer.pad_to(snapshot::entries_offset<Entry>(SnapshotLayout::Sorted,0));
+  std::vector<unsigned char> chunk(CHUNK*sizeof(Entry));
+  std::size_t filled=0;
+  for(auto it=map.begin();it!=map.end();++it)
+  {
+    if(filled==CHUNK)
+    {
+        writer.write(chunk.data(),filled*sizeof(Entry));
+        std::fill(chunk.begin(),chunk.end(),0);
+        filled=0;
+    }
+    snapshot::put_entry<Entry>(chunk.data()+filled*sizeof(Entry),it->first,it->second);
+    ++filled;
+  }
+  writer.write(chunk.data(),filled*sizeof(Entry));
+  writer.commit();
+}
+
+// writes the map as an open addressing table filled to at most half
+template <typename KeyType, typename ValueType, typename Hasher, typename KeyEqual>
+void saveSnapshot(const HashMap<KeyType, ValueType, Hasher, KeyEqual>& map, const std::string& path)
+{
+  using Entry = SnapshotEntry<KeyType, ValueType>;
+
+  std::uint64_t slots=8;
+  while(slots<2*map.getSize()) slots<<=1;
+  std::vector<std::uint64_t> tags(slots,0);
+  std::vector<unsigned char> entries(slots*sizeof(Entry),0);
+  for(auto it=map.begin();it!=map.end();++it)
+  {
+    std::uint64_t hash=snapshotHash(it->first);
+    std::uint64_t tag=hash | (std::uint64_t(1)<<63);
+    std::uint64_t slot=hash & (slots-1);
+    while(tags[slot]) slot=(slot+1) & (slots-1);
+    tags[slot]=tag;
+    snapshot::put_entry<Entry>(entries.data()+slot*sizeof(Entry),it->first,it->second);
+  }
+
+  snapshot::Writer writer(path,snapshot::make_header<Entry>(SnapshotLayout::Hashed,map.getSize(),slots));
+  writer.write(tags.data(),slots*sizeof(std::uint64_t));
+  writer.pad_to(snapshot::entries_offset<Entry>(SnapshotLayout::Hashed,slots));
+  writer.write(entries.data(),entries.size());
+  writer.commit();
+}
+
+// Read-only TreeMap snapshot served straight from the mapped file: binary search over the sorted
+// entries, iteration in key order. verify=false skips the checksum, which otherwise reads the
+// whole file once on opening.
+template <typename KeyType, typename ValueType>
+class FrozenTreeMapView
+{
+public:
+  using key_type = KeyType;
+  using mapped_type = ValueType;
+  using value_type = SnapshotEntry<KeyType, ValueType>;
+  using size_type = std::size_t;
+  using const_reference = const value_type&;
+  using const_iterator = const value_type*;
+
+  explicit FrozenTreeMapView(const std::string& path, bool verify=true) : file(path), entries(nullptr), Size(0)
+  {
+    const SnapshotHeader& header=snapshot::open_header<value_type>(file,SnapshotLayout::Sorted,verify);
+    Size=header.count;
+    entries=reinterpret_cast<const value_type*>(file.data()+snapshot::entries_offset<value_type>(SnapshotLayout::Sorted,0));
+  }
+
+  size_type getSize() const
+  {
+    return Size;
+  }
+
+  bool isEmpty() const
+  {
+    return !Size;
+  }
+
+  const_iterator find(const key_type& key) const
+  {
+    const_iterator it=lower_bound(key);
+    if(it!=end() && !(key < it->first)) return it;
+    return end();
+  }
+
+  const mapped_type& valueOf(const key_type& key) const
+  {
+    const_iterator it=find(key);
+    if(it==end())
+        throw std::out_of_range("valueOf");
+    return it->second;
+  }
+
+  // first entry whose key is not less than key
+  const_iterator lower_bound(const key_type& key) const
+  {
+    const_iterator first=entries;
+    size_type n=Size;
+    while(n>0)
+    {
+        size_type half=n/2;
+        if(first[half].first < key)
+        {
+            first+=half+1;
+            n-=half+1;
+        }
+        else n=half;
+    }
+    return first;
+  }
+
+  // first entry whose key is greater than key
+  const_iterator upper_bound(const key_type& key) const
+  {
+    const_iterator first=entries;
+    size_type n=Size;
+    while(n>0)
+    {
+        size_type half=n/2;
+        if(!(key < first[half].first))
+        {
+            first+=half+1;
+            n-=half+1;
+        }
+        else n=half;
+    }
+    return first;
+  }
+
+  const_iterator begin() const
+  {
+    return entries;
+  }
+
+  const_iterator end() const
+  {
+    return entries+Size;
+  }
+
+private:
+  MappedFile file;
+  const value_type *entries;
+  size_type Size;
+};
+
+// Read-only HashMap snapshot served straight from the mapped file; iteration is in slot order.
+template <typename KeyType, typename ValueType>
+class FrozenHashMapView
+{
+public:
+  using key_type = KeyType;
+  using mapped_type = ValueType;
+  using value_type = SnapshotEntry<KeyType, ValueType>;
+  using size_type = std::size_t;
+  using const_reference = const value_type&;
+
+  class ConstIterator;
+  using const_iterator = ConstIterator;
+
+  explicit FrozenHashMapView(const std::string& path, bool verify=true) : file(path), tags(nullptr), entries(nullptr), Size(0), SLOTS(0)
+  {
+    const SnapshotHeader& header=snapshot::open_header<value_type>(file,SnapshotLayout::Hashed,verify);
+    Size=header.count;
+    SLOTS=header.slots;
+    tags=reinterpret_cast<const std::uint64_t*>(file.data()+sizeof(SnapshotHeader));
+    entries=reinterpret_cast<const value_type*>(file.data()+snapshot::entries_offset<value_type>(SnapshotLayout::Hashed,SLOTS));
+  }
+
+  size_type getSize() const
+  {
+    return Size;
+  }
+
+  bool isEmpty() const
+  {
+    return !Size;
+  }
+
+  const_iterator find(const key_type& key) const
+  {
+    std::uint64_t hash=snapshotHash(key);
+    std::uint64_t tag=hash | (std::uint64_t(1)<<63);
+    size_type slot=hash & (SLOTS-1);
+    // at most SLOTS probes, as a file opened without verify may have no empty slot left
+    for(size_type probes=0;probes<SLOTS && tags[slot];++probes,slot=(slot+1) & (SLOTS-1))
+        if(tags[slot]==tag && entries[slot].first==key)
+            return ConstIterator(this,slot);
+    return end();
+  }
+
+  const mapped_type& valueOf(const key_type& key) const
+  {
+    const_iterator it=find(key);
+    if(it==end())
+        throw std::out_of_range("valueOf");
+    return it->second;
+  }
+
+  const_iterator begin() const
+  {
+    return ConstIterator(this,next_used(0));
+  }
+
+  const_iterator end() const
+  {
+    return ConstIterator(this,SLOTS);
+  }
+
+private:
+  MappedFile file;
+  const std::uint64_t *tags;
+  const value_type *entries;
+  size_type Size;
+  size_type SLOTS;
+
+  size_type next_used(size_type slot) const
+  {
+    while(slot<SLOTS && !tags[slot]) ++slot;
+    return slot;
+  }
+};
+
+template <typename KeyType, typename ValueType>
+class FrozenHashMapView<KeyType, ValueType>::ConstIterator
+{
+public:
+  using reference = typename FrozenHashMapView::const_reference;
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = typename FrozenHashMapView::value_type;
+  using pointer = const typename FrozenHashMapView::value_type*;
+
+  explicit ConstIterator(const FrozenHashMapView *v=nullptr, size_type s=0) : view(v), slot(s) {}
+
+  ConstIterator& operator++()
+  {
+    if(view==nullptr || slot>=view->SLOTS)
+        throw std::out_of_range("++");
+    slot=view->next_used(slot+1);
+    return *this;
+  }
+
+  ConstIterator operator++(int)
+  {
+    ConstIterator temp=*this;
+    operator++();
+    return temp;
+  }
+
+  reference operator*() const
+  {
+    if(view==nullptr || slot>=view->SLOTS)
+        throw std::out_of_range("*");
+    return view->entries[slot];
+  }
+
+  pointer operator->() const
+  {
+    return &this->operator*();
+  }
+
+  bool operator==(const ConstIterator& other) const
+  {
+    return view==other.view && slot==other.slot;
+  }
+
+  bool operator!=(const ConstIterator& other) const
+  {
+    return !(*this == other);
+  }
+
+private:
+  const FrozenHashMapView *view;
+  size_type slot;
+};
+
+// rebuilds a TreeMap from a snapshot, in linear time when the map orders keys by operator< as
+// the file does; the map keeps its Compare
+template <typename KeyType, typename ValueType, typename Compare>
+void loadSnapshot(const std::string& path, TreeMap<KeyType, ValueType, Compare>& map)
+{
+  FrozenTreeMapView<KeyType, ValueType> view(path);
+  if constexpr(orders_by_less<Compare, KeyType>::value)
+    map.assignSorted(view.begin(),view.end());
+  else
+    map=TreeMap<KeyType, ValueType, Compare>(view.begin(),view.end(),map.key_comp());
+}
+
+// the map keeps its Hasher and KeyEqual
+template <typename KeyType, typename ValueType, typename Hasher, typename KeyEqual>
+void loadSnapshot(const std::string& path, HashMap<KeyType, ValueType, Hasher, KeyEqual>& map)
+{
+  FrozenHashMapView<KeyType, ValueType> view(path);
+  HashMap<KeyType, ValueType, Hasher, KeyEqual> loaded(0,map.hash_function(),map.key_eq());
+  loaded.reserve(view.getSize());
+  for(auto it=view.begin();it!=view.end();++it)
+    loaded.try_emplace(it->first,it->second);
+  map=std::move(loaded);
+}
+
+}
+
+#endif /* AISDI_MAPS_SNAPSHOT_H */
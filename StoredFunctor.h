@@ -0,0 +1,45 @@
+#ifndef AISDI_MAPS_STOREDFUNCTOR_H
+#define AISDI_MAPS_STOREDFUNCTOR_H
+
+#include <type_traits>
+
+namespace aisdi
+{
+
+// Holds a map's hasher, key equality or comparator. Maps derive from it privately, so a
+// stateless functor takes no room in the map (empty base optimization); Tag keeps apart two
+// holders of the same functor type in one map. get() is to be called qualified with the holder.
+template <typename F, int Tag, bool = std::is_empty<F>::value && !std::is_final<F>::value>
+class StoredFunctor
+{
+public:
+  StoredFunctor() = default;
+
+  explicit StoredFunctor(const F& f) : functor(f) {}
+
+  const F& get() const
+  {
+    return functor;
+  }
+
+private:
+  F functor;
+};
+
+template <typename F, int Tag>
+class StoredFunctor<F, Tag, true> : private F
+{
+public:
+  StoredFunctor() = default;
+
+  explicit StoredFunctor(const F& f) : F(f) {}
+
+  const F& get() const
+  {
+    return *this;
+  }
+};
+
+}
+
+#endif /* AISDI_MAPS_STOREDFUNCTOR_H */
@@ -2,19 +2,37 @@
 #define AISDI_MAPS_TREEMAP_H
 
 #include <cstddef>
+#include <functional>
 #include <initializer_list>
+#include <iterator>
+#include <new>
 #include <stdexcept>
+#include <tuple>
+#include <type_traits>
 #include <utility>
+#include <vector>
+
+#include "StoredFunctor.h"
 
 namespace aisdi
 {
 
-template <typename KeyType, typename ValueType>
-class TreeMap
+// true for the comparators ordering keys just as operator< does, for code that relies on that order
+template <typename Compare, typename Key>
+struct orders_by_less
+  : std::bool_constant<std::is_same<Compare, std::less<Key>>::value || std::is_same<Compare, std::less<>>::value>
+{};
+
+// Compare orders the keys like std::less; keys a and b are equivalent when neither is less.
+// The map keeps its own Compare, given to the constructor and copied with the map; a stateless one takes no room.
+// Defining AISDI_MAPS_STATS makes the map count its rotations for stats(); without it they cost nothing
+template <typename KeyType, typename ValueType, typename Compare = std::less<KeyType>>
+class TreeMap : private StoredFunctor<Compare, 0>
 {
 public:
   using key_type = KeyType;
   using mapped_type = ValueType;
+  using key_compare = Compare;
   using value_type = std::pair<const key_type, mapped_type>;
   using size_type = std::size_t;
   using reference = value_type&;
@@ -26,37 +44,166 @@ public:
   using const_iterator = ConstIterator;
 
 private:
+    using StoredCompare = StoredFunctor<key_compare, 0>;
+
     struct Node
     {
-        value_type *data;
+        value_type data;
         Node *parent;
         Node *left;
         Node *right;
         int balance; //wpsolczynnik rownowagi
+        size_type count; //nodes in this subtree
+
+        template <typename... Args>
+        explicit Node(Args&&... args) : data(std::forward<Args>(args)...), parent(nullptr), left(nullptr), right(nullptr), balance(0), count(1) {}
+
+    };
+
+    // hands out nodes from slabs owned by the map, freed nodes are reused through a free list
+    class NodePool
+    {
+        union Slot
+        {
+            Slot *next;
+            alignas(Node) unsigned char storage[sizeof(Node)];
+        };
+
+        // the aligned operator new, as keys or values may need more than the default alignment
+        static constexpr std::align_val_t ALIGNMENT=std::align_val_t(alignof(Slot));
+        static const size_t FIRST_SLAB=16;
+        static const size_t MAX_SLAB=4096;
+
+        std::vector<Slot*> slabs;
+        Slot *free_list;
+        size_t used; //slots taken from the newest slab
+        size_t slab_size;
+
+    public:
+        NodePool() : free_list(nullptr), used(0), slab_size(0) {}
+
+        NodePool(const NodePool&) = delete;
+        NodePool& operator=(const NodePool&) = delete;
+
+        ~NodePool()
+        {
+            release();
+        }
+
+        template <typename... Args>
+        Node* create(Args&&... args)
+        {
+            Slot *slot=free_list;
+            if(slot) free_list=slot->next;
+            else
+            {
+                if(used==slab_size)
+                {
+                    size_t next_size= slab_size ? (slab_size<MAX_SLAB ? slab_size*2 : MAX_SLAB) : FIRST_SLAB;
+                    slabs.reserve(slabs.size()+1);
+                    slabs.push_back(static_cast<Slot*>(::operator new(next_size*sizeof(Slot),ALIGNMENT)));
+                    slab_size=next_size;
+                    used=0;
+                }
+                slot=slabs.back()+used++;
+            }
+            try
+            {
+                return new (slot->storage) Node(std::forward<Args>(args)...);
+            }
+            catch(...)
+            {
+                slot->next=free_list;
+                free_list=slot;
+                throw;
+            }
+        }
 
-        Node() : data(nullptr), parent(nullptr), left(nullptr), right(nullptr), balance(0) {}
+        void destroy(Node *node)
+        {
+            node->~Node();
+            Slot *slot=reinterpret_cast<Slot*>(node);
+            slot->next=free_list;
+            free_list=slot;
+        }
 
+        // drops every slab at once, nodes must have been destroyed already
+        void release()
+        {
+            for(auto it=slabs.begin();it!=slabs.end();++it)
+                ::operator delete(*it,ALIGNMENT);
+            slabs.clear();
+            free_list=nullptr;
+            used=slab_size=0;
+        }
+
+        // slabs and the list of them, whether the slots are in use or not
+        size_t bytes() const
+        {
+            size_t total=slabs.capacity()*sizeof(Slot*);
+            size_t size=FIRST_SLAB;
+            for(size_t i=0;i<slabs.size();++i)
+            {
+                total+=size*sizeof(Slot);
+                if(size<MAX_SLAB) size*=2;
+            }
+            return total;
+        }
+
+        void swap(NodePool& other)
+        {
+            slabs.swap(other.slabs);
+            std::swap(free_list,other.free_list);
+            std::swap(used,other.used);
+            std::swap(slab_size,other.slab_size);
+        }
     };
 
   Node *root;
   size_type Size;
+  NodePool pool;
+
+#ifdef AISDI_MAPS_STATS
+  struct Rotations
+  {
+    size_type ll=0, rr=0, lr=0, rl=0;
+  } rotations; //done by this object, not carried over by copies or moves
+#endif
+
+  static const size_type BATCH=16; //searches in flight per batched lookup
+
+  bool Less(const key_type& a, const key_type& b) const
+  {
+      return StoredCompare::get()(a,b);
+  }
 
 public:
   TreeMap() : root(nullptr), Size(0) {}
 
-  TreeMap(std::initializer_list<value_type> list) : TreeMap()
+  explicit TreeMap(const key_compare& compare) : StoredCompare(compare), root(nullptr), Size(0) {}
+
+  TreeMap(std::initializer_list<value_type> list, const key_compare& compare=key_compare())
+    : TreeMap(list.begin(),list.end(),compare) {}
+
+  // linear time when the keys come strictly increasing, otherwise inserted one by one (last value wins)
+  template <typename ForwardIt>
+  TreeMap(ForwardIt first, ForwardIt last, const key_compare& compare=key_compare()) : TreeMap(compare)
   {
-    for(auto it=list.begin();it!=list.end();++it)
-        this->operator[](it->first)=it->second;
+    if(is_sorted(first,last))
+        build_sorted(first,last);
+    else
+        for(;first!=last;++first)
+            insert_or_assign(first->first,first->second);
   }
 
-  TreeMap(const TreeMap& other) : TreeMap()
+  // clones the structure node for node, no comparisons or rotations
+  TreeMap(const TreeMap& other) : TreeMap(other.StoredCompare::get())
   {
-    for(auto it=other.begin();it!=other.end();++it)
-        this->operator[](it->first)=it->second;
+    clone(root,other.root,nullptr);
+    Size=other.Size;
   }
 
-  TreeMap(TreeMap&& other) : TreeMap()
+  TreeMap(TreeMap&& other) : TreeMap(other.StoredCompare::get())
   {
     *this=std::move(other);
   }
@@ -71,22 +218,32 @@ public:
   {
     if(this==&other) return *this;
 
-    remove_all(root);
-    Size=0;
-    root=nullptr;
-    for(auto it=other.begin();it!=other.end();++it)
-        this->operator[](it->first)=it->second;
-    return *this;
+    TreeMap copy(other);
+    return *this=std::move(copy);
+  }
+
+  // replaces the contents with a range of strictly increasing keys in O(n), the result is
+  // perfectly balanced; throws std::invalid_argument (leaving the map as it was) if it is not sorted
+  template <typename ForwardIt>
+  void assignSorted(ForwardIt first, ForwardIt last)
+  {
+    if(!is_sorted(first,last))
+        throw std::invalid_argument("assignSorted");
+    TreeMap built(StoredCompare::get());
+    built.build_sorted(first,last);
+    *this=std::move(built);
   }
 
   TreeMap& operator=(TreeMap&& other)
   {
     if(this==&other) return *this;
 
+    StoredCompare::operator=(other);
     remove_all(root);
 
     root=other.root;
     Size=other.Size;
+    pool.swap(other.pool);
 
     other.root=nullptr;
     other.Size=0;
@@ -94,6 +251,11 @@ public:
     return *this;
   }
 
+  key_compare key_comp() const
+  {
+    return StoredCompare::get();
+  }
+
   bool isEmpty() const
   {
     return !Size;
@@ -101,101 +263,67 @@ public:
 
   mapped_type& operator[](const key_type& key)
   {
-        Node *temp=new Node;
-        temp->data=new value_type(key, mapped_type{});
-
-        Node *p=root;
-
-        if(p==nullptr)
-        {
-            root = temp;
-            Size++;
-            return temp->data->second;
-        }
-
-        while(true)
-        {
-            if(key==p->data->first)
-            {
-
-                    delete temp->data;
-                    delete temp;
-                    return p->data->second;
-            }
-
-            if(key < p->data->first)
-            {
-                if(p->left==nullptr)
-                {
-                    p->left=temp;
-                    break;
-                }
-                p=p->left;
-            }
-            else
-            {
-                if(p->right==nullptr)
-                {
-                    p->right=temp;
-                    break;
-                }
-                p=p->right;
-            }
-        }
-
-        temp->parent=p;
-
-        if(p->balance)
-        {
-            p->balance=0;
-            Size++;
-            return temp->data->second;
-        }
+    return try_emplace(key).first->second;
+  }
 
-        if(p->left == temp) p->balance=1;
-        else  p->balance=-1;
+  mapped_type& operator[](key_type&& key)
+  {
+    return try_emplace(std::move(key)).first->second;
+  }
 
-        Node *p_parent=p->parent;
-        bool unbalanced=false;
+  // constructs the value in place from args if key is absent; on a hit nothing is constructed
+  // and args are left untouched
+  template <typename... Args>
+  std::pair<iterator,bool> try_emplace(const key_type& key, Args&&... args)
+  {
+    return emplace_key(key,std::forward<Args>(args)...);
+  }
 
-        while(p_parent)
-        {
-            if(p_parent->balance)
-            {
-                unbalanced = true;
-                break;
-            }
+  template <typename... Args>
+  std::pair<iterator,bool> try_emplace(key_type&& key, Args&&... args)
+  {
+    return emplace_key(std::move(key),std::forward<Args>(args)...);
+  }
 
-            if(p_parent->left==p)  p_parent->balance=1;
-            else p_parent->balance=-1;
+  // inserts, or assigns to the value already there; the bool tells which
+  template <typename M>
+  std::pair<iterator,bool> insert_or_assign(const key_type& key, M&& value)
+  {
+    auto result=emplace_key(key,std::forward<M>(value));
+    if(!result.second) result.first->second=std::forward<M>(value);
+    return result;
+  }
 
-            p=p_parent;
-            p_parent=p_parent->parent;
-        }
+  template <typename M>
+  std::pair<iterator,bool> insert_or_assign(key_type&& key, M&& value)
+  {
+    auto result=emplace_key(std::move(key),std::forward<M>(value));
+    if(!result.second) result.first->second=std::forward<M>(value);
+    return result;
+  }
 
-        if(unbalanced)
+  // args as for value_type; a key and a value, or a pair, are looked up before anything is built,
+  // anything else is built first and given back if the key is already there
+  template <typename First, typename... Rest>
+  std::pair<iterator,bool> emplace(First&& first, Rest&&... rest)
+  {
+    if constexpr(sizeof...(Rest)==1 && std::is_same<typename std::decay<First>::type,key_type>::value)
+        return emplace_key(std::forward<First>(first),std::forward<Rest>(rest)...);
+    else if constexpr(sizeof...(Rest)==0 && is_pair<typename std::decay<First>::type>::value)
+        return emplace_key(std::forward<First>(first).first,std::forward<First>(first).second);
+    else
+    {
+        Node *temp=pool.create(std::forward<First>(first),std::forward<Rest>(rest)...);
+        Node *parent=nullptr;
+        Node *found=find_parent(temp->data.first,parent);
+        if(found)
         {
-            if(p_parent->balance==1)
-            {
-                if(p_parent->right==p) p_parent->balance=0;
-
-                else if(p->balance == -1)
-                    LR(p_parent);
-                else
-                    LL(p_parent);
-            }
-            else
-            {
-                if(p_parent->left==p) p_parent->balance=0;
-
-                else if(p->balance==1)
-                    RL(p_parent);
-                else
-                    RR(p_parent);
-            }
+            pool.destroy(temp);
+            return std::make_pair(Iterator(found,this),false);
         }
-        Size++;
-        return temp->data->second;
+        insert_node(parent,temp);
+        return std::make_pair(Iterator(temp,this),true);
+    }
   }
 
   const mapped_type& valueOf(const key_type& key) const
@@ -203,7 +331,7 @@ public:
     const Node *current=find_node(key);
     if(current==nullptr)
         throw std::out_of_range("const_valueOf");
-    return current->data->second;
+    return current->data.second;
   }
 
   mapped_type& valueOf(const key_type& key)
@@ -211,7 +339,26 @@ public:
     Node *current=find_node(key);
     if(current==nullptr)
         throw std::out_of_range("valueOf");
-    return current->data->second;
+    return current->data.second;
+  }
+
+  // the non-throwing lookups: a miss costs what a hit does
+  bool contains(const key_type& key) const
+  {
+    return find_node(key)!=nullptr;
+  }
+
+  // pointer to the value, nullptr on a miss; stays valid until that element is removed
+  const mapped_type* tryGet(const key_type& key) const
+  {
+    const Node *node=find_node(key);
+    return node ? &node->data.second : nullptr;
+  }
+
+  mapped_type* tryGet(const key_type& key)
+  {
+    Node *node=find_node(key);
+    return node ? &node->data.second : nullptr;
   }
 
   const_iterator find(const key_type& key) const
@@ -226,14 +373,189 @@ public:
     return it;
   }
 
+  // first element whose key is not less than key
+  const_iterator lower_bound(const key_type& key) const
+  {
+    return ConstIterator(lower_bound_node(key),this);
+  }
+
+  iterator lower_bound(const key_type& key)
+  {
+    return Iterator(lower_bound_node(key),this);
+  }
+
+  // first element whose key is greater than key
+  const_iterator upper_bound(const key_type& key) const
+  {
+    return ConstIterator(upper_bound_node(key),this);
+  }
+
+  iterator upper_bound(const key_type& key)
+  {
+    return Iterator(upper_bound_node(key),this);
+  }
+
+  std::pair<const_iterator,const_iterator> equal_range(const key_type& key) const
+  {
+    return std::make_pair(lower_bound(key),upper_bound(key));
+  }
+
+  std::pair<iterator,iterator> equal_range(const key_type& key)
+  {
+    return std::make_pair(lower_bound(key),upper_bound(key));
+  }
+
+  // calls visit on every element with from <= key < to in key order, returns how many were visited
+  template <typename Visitor>
+  size_type forEachInRange(const key_type& from, const key_type& to, Visitor visit) const
+  {
+    size_type visited=0;
+    for(Node *node=lower_bound_node(from);node!=nullptr && Less(node->data.first,to);node=next_node(node))
+    {
+        visit(static_cast<const value_type&>(node->data));
+        ++visited;
+    }
+    return visited;
+  }
+
+  template <typename Visitor>
+  size_type forEachInRange(const key_type& from, const key_type& to, Visitor visit)
+  {
+    size_type visited=0;
+    for(Node *node=lower_bound_node(from);node!=nullptr && Less(node->data.first,to);node=next_node(node))
+    {
+        visit(node->data);
+        ++visited;
+    }
+    return visited;
+  }
+
+  // k-th smallest element counting from 0, end() if k>=getSize()
+  const_iterator select(size_type k) const
+  {
+    return ConstIterator(select_node(k),this);
+  }
+
+  iterator select(size_type k)
+  {
+    return Iterator(select_node(k),this);
+  }
+
+  // number of keys less than key
+  size_type rank(const key_type& key) const
+  {
+    size_type less=0;
+    Node *node=root;
+    while(node!=nullptr)
+    {
+        if(Less(node->data.first,key))
+        {
+            less+=count(node->left)+1;
+            node=node->right;
+        }
+        else node=node->left;
+    }
+    return less;
+  }
+
+  // number of keys k with from <= k < to
+  size_type countRange(const key_type& from, const key_type& to) const
+  {
+    if(!Less(from,to)) return 0;
+    return rank(to)-rank(from);
+  }
+
+  struct Stats
+  {
+    size_type size;
+    size_type height; //nodes on the longest path from the root, 0 when empty
+    double averageDepth; //nodes on the path from the root to a node, the comparisons of a hit
+    size_type rotationsLL, rotationsRR, rotationsLR, rotationsRL; //0 without AISDI_MAPS_STATS
+    size_type bytesAllocated; //the map object and its node slabs
+    double bytesPerEntry;
+  };
+
+  // a run of consecutive elements by rank, for scans split over threads (see Parallel.h); it is
+  // split at a rank and found by descending the subtree counts, so the halves are always even.
+  // A slice only reads, so any number of them can be walked at once while the map is not modified
+  class Slice
+  {
+  public:
+    static const size_type GRAIN=2048; //elements below which a slice is not split further
+
+    bool divisible() const
+    {
+      return last-first>GRAIN;
+    }
+
+    std::pair<Slice,Slice> split() const
+    {
+      size_type middle=first+(last-first)/2;
+      return std::make_pair(Slice(tree,first,middle),Slice(tree,middle,last));
+    }
+
+    // calls visit(const value_type&) for the elements in order
+    template <typename Visitor>
+    void forEach(Visitor&& visit) const
+    {
+      Node *node= first<last ? tree->select_node(first) : nullptr;
+      for(size_type k=first;k<last;++k)
+      {
+        visit(node->data);
+        node=tree->next_node(node);
+      }
+    }
+
+  private:
+    friend class TreeMap;
+
+    Slice(const TreeMap *t, size_type f, size_type l) : tree(t), first(f), last(l) {}
+
+    const TreeMap *tree;
+    size_type first;
+    size_type last;
+  };
+
+  Slice slice() const
+  {
+    return Slice(this,0,Size);
+  }
+
+  // walks the whole tree, O(n)
+  Stats stats() const
+  {
+    Stats result{Size,0,0.0,0,0,0,0,sizeof(*this)+pool.bytes(),0.0};
+    size_type total_depth=0;
+    result.height=sum_depths(root,1,total_depth);
+#ifdef AISDI_MAPS_STATS
+    result.rotationsLL=rotations.ll;
+    result.rotationsRR=rotations.rr;
+    result.rotationsLR=rotations.lr;
+    result.rotationsRL=rotations.rl;
+#endif
+    if(Size!=0)
+    {
+        result.averageDepth=double(total_depth)/Size;
+        result.bytesPerEntry=double(result.bytesAllocated)/Size;
+    }
+    return result;
+  }
+
   void remove(const key_type& key)
   {
     Node *tmp=find_node(key);
     if(tmp==nullptr)
         throw std::out_of_range("remove");
-    remove_node(tmp);
-    delete tmp->data;
-    delete tmp;
+    erase_node(tmp);
+  }
+
+  // remove() that does not throw, returns how many elements went (0 or 1)
+  size_type erase(const key_type& key)
+  {
+    Node *tmp=find_node(key);
+    if(tmp==nullptr) return 0;
+    erase_node(tmp);
+    return 1;
   }
 
   void remove(const const_iterator& it)
@@ -241,9 +563,31 @@ public:
     Node *tmp=it.node;
     if(tmp==nullptr)
         throw std::out_of_range("remove");
-    remove_node(tmp);
-    delete tmp->data;
-    delete tmp;
+    erase_node(tmp);
+  }
+
+  // find() for n keys at once: results[i] is the iterator for keys[i], end() on a miss
+  void findBatch(const key_type *keys, size_type n, const_iterator *results) const
+  {
+    lookup_batch(keys,n,[&](size_type i, Node *node) {
+        results[i]=ConstIterator(node,this);
+    });
+  }
+
+  // valueOf() for n keys at once without throwing: found[i] tells whether values[i] was written,
+  // returns the number of hits
+  size_type valueOfBatch(const key_type *keys, size_type n, mapped_type *values, bool *found) const
+  {
+    size_type hits=0;
+    lookup_batch(keys,n,[&](size_type i, Node *node) {
+        found[i]=node!=nullptr;
+        if(node)
+        {
+            values[i]=node->data.second;
+            ++hits;
+        }
+    });
+    return hits;
   }
 
   size_type getSize() const
@@ -302,20 +646,254 @@ public:
 
 private:
 
+  // frees the whole tree; nodes only need visiting when the pair has a destructor to run
   void remove_all(Node *A)
+    {
+        if(!std::is_trivially_destructible<value_type>::value)
+            destroy_all(A);
+        pool.release();
+        root=nullptr;
+    }
+
+  void destroy_all(Node *A)
     {
         if(A==nullptr) return;
+        destroy_all(A->left);
+        destroy_all(A->right);
+        A->~Node();
+    }
+
+  // adds the depth of every node under A to total, A being at depth; returns the height of A
+  static size_type sum_depths(const Node *A, size_type depth, size_type& total)
+    {
+        if(A==nullptr) return 0;
+        total+=depth;
+        size_type left=sum_depths(A->left,depth+1,total);
+        size_type right=sum_depths(A->right,depth+1,total);
+        return (left>right ? left : right)+1;
+    }
+
+  template <typename ForwardIt>
+  bool is_sorted(ForwardIt first, ForwardIt last) const
+  {
+    if(first==last) return true;
+    for(ForwardIt next=std::next(first);next!=last;first=next++)
+        if(!Less(first->first,next->first)) return false;
+    return true;
+  }
+
+  // empty map only; all nodes are made first so a throwing constructor leaves nothing half linked
+  template <typename ForwardIt>
+  void build_sorted(ForwardIt first, ForwardIt last)
+  {
+    std::vector<Node*> nodes;
+    nodes.reserve(std::distance(first,last));
+    try
+    {
+        for(;first!=last;++first)
+            nodes.push_back(pool.create(first->first,first->second));
+    }
+    catch(...)
+    {
+        for(auto it=nodes.begin();it!=nodes.end();++it)
+            pool.destroy(*it);
+        throw;
+    }
+    root=link_sorted(nodes.data(),nodes.size(),nullptr);
+    Size=nodes.size();
+  }
+
+  // middle node becomes the root; the left half is never smaller than the right,
+  // so subtrees of equal size have equal height and the balance follows from the sizes
+  static Node* link_sorted(Node **nodes, size_type n, Node *parent)
+  {
+    if(n==0) return nullptr;
+    size_type left=n/2;
+    Node *A=nodes[left];
+    A->parent=parent;
+    A->left=link_sorted(nodes,left,A);
+    A->right=link_sorted(nodes+left+1,n-left-1,A);
+    A->count=n;
+    A->balance=height_of(left)-height_of(n-left-1);
+    return A;
+  }
+
+  // height of a tree of n nodes built by link_sorted
+  static int height_of(size_type n)
+  {
+    int height=0;
+    for(;n;n>>=1) ++height;
+    return height;
+  }
+
+  // copies src below parent into slot, linking as it goes so a throw leaves a tree remove_all can free
+  void clone(Node *&slot, const Node *src, Node *parent)
+  {
+    if(src==nullptr) return;
+    Node *A=pool.create(src->data);
+    A->parent=parent;
+    A->balance=src->balance;
+    A->count=src->count;
+    slot=A;
+    clone(A->left,src->left,A);
+    clone(A->right,src->right,A);
+  }
+
+  template <typename T>
+  struct is_pair : std::false_type {};
+
+  template <typename A, typename B>
+  struct is_pair<std::pair<A,B>> : std::true_type {};
+
+  // the node where key is, or nullptr and the parent a new node for key would hang from
+  Node* find_parent(const key_type& key, Node *&parent) const
+  {
+        Node *p=root;
+        parent=nullptr;
+        while(p!=nullptr)
+        {
+            parent=p;
+            if(Less(key,p->data.first)) p=p->left;
+            else if(Less(p->data.first,key)) p=p->right;
+            else return p;
+        }
+        return nullptr;
+  }
+
+  template <typename K, typename... Args>
+  std::pair<iterator,bool> emplace_key(K&& key, Args&&... args)
+  {
+        Node *parent=nullptr;
+        Node *found=find_parent(key,parent);
+        if(found)
+            return std::make_pair(Iterator(found,this),false);
+
+        Node *temp=pool.create(std::piecewise_construct,std::forward_as_tuple(std::forward<K>(key)),
+                               std::forward_as_tuple(std::forward<Args>(args)...));
+        insert_node(parent,temp);
+        return std::make_pair(Iterator(temp,this),true);
+  }
+
+  void erase_node(Node *A)
+    {
+        remove_node(A);
+        --Size;
+        pool.destroy(A);
+    }
+
+  // links a fresh node below parent (nullptr for an empty tree) and restores the AVL balance
+  void insert_node(Node *parent, Node *temp)
+  {
+        Node *p=parent;
+
+        if(p==nullptr)
+        {
+            root = temp;
+            Size++;
+            return;
+        }
+
+        if(Less(temp->data.first,p->data.first)) p->left=temp;
+        else p->right=temp;
+
+        temp->parent=p;
+        for(Node *A=p;A!=nullptr;A=A->parent)
+            ++A->count;
+
+        if(p->balance)
+        {
+            p->balance=0;
+            Size++;
+            return;
+        }
+
+        if(p->left == temp) p->balance=1;
+        else  p->balance=-1;
+
+        Node *p_parent=p->parent;
+        bool unbalanced=false;
+
+        while(p_parent)
+        {
+            if(p_parent->balance)
+            {
+                unbalanced = true;
+                break;
+            }
+
+            if(p_parent->left==p)  p_parent->balance=1;
+            else p_parent->balance=-1;
+
+            p=p_parent;
+            p_parent=p_parent->parent;
+        }
+
+        if(unbalanced)
+        {
+            if(p_parent->balance==1)
+            {
+                if(p_parent->right==p) p_parent->balance=0;
+
+                else if(p->balance == -1)
+                    LR(p_parent);
+                else
+                    LL(p_parent);
+            }
+            else
+            {
+                if(p_parent->left==p) p_parent->balance=0;
+
+                else if(p->balance==1)
+                    RL(p_parent);
+                else
+                    RR(p_parent);
+            }
+        }
+        Size++;
+  }
+
+static size_type count(const Node *A)
+{
+    return A ? A->count : 0;
+}
+
+static void update_count(Node *A)
+{
+    A->count=1+count(A->left)+count(A->right);
+}
+
+Node* select_node(size_type k) const
+{
+    Node *node=root;
+    while(node!=nullptr)
+    {
+        size_type left=count(node->left);
+        if(k<left) node=node->left;
+        else if(k==left) break;
         else
         {
-            remove_all(A->left);
-            remove_all(A->right);
-            delete A->data;
-            delete A;
+            k-=left+1;
+            node=node->right;
         }
     }
+    return node;
+}
+
+// position of node in key order, getSize() for nullptr (end)
+size_type node_rank(const Node *A) const
+{
+    if(A==nullptr) return Size;
+    size_type position=count(A->left);
+    for(;A->parent!=nullptr;A=A->parent)
+        if(A->parent->right==A) position+=count(A->parent->left)+1;
+    return position;
+}
 
 void RR(Node *A)
 {
+#ifdef AISDI_MAPS_STATS
+    ++rotations.rr;
+#endif
     Node *B=A->right;
     Node *p=A->parent;
 
@@ -337,10 +915,16 @@ void RR(Node *A)
 
     if(B->balance==-1) A->balance=B->balance=0;
     else {A->balance=-1; B->balance=1;}
+
+    update_count(A);
+    update_count(B);
 }
 
 void LL(Node *A)
 {
+#ifdef AISDI_MAPS_STATS
+    ++rotations.ll;
+#endif
     Node *B=A->left;
     Node *p=A->parent;
 
@@ -362,10 +946,16 @@ void LL(Node *A)
 
     if(B->balance==1) A->balance=B->balance=0;
     else {A->balance=1; B->balance=-1;}
+
+    update_count(A);
+    update_count(B);
 }
 
 void RL(Node *A)
 {
+#ifdef AISDI_MAPS_STATS
+    ++rotations.rl;
+#endif
     Node *B=A->right;
     Node *C=B->left;
     Node *p=A->parent;
@@ -396,10 +986,17 @@ void RL(Node *A)
     else B->balance=0;
 
     C->balance=0;
+
+    update_count(A);
+    update_count(B);
+    update_count(C);
 }
 
 void LR(Node *A)
 {
+#ifdef AISDI_MAPS_STATS
+    ++rotations.lr;
+#endif
     Node *B=A->left;
     Node *C=B->right;
     Node *p=A->parent;
@@ -430,21 +1027,107 @@ void LR(Node *A)
     else A->balance=0;
 
     C->balance=0;
+
+    update_count(A);
+    update_count(B);
+    update_count(C);
 }
 
 
+// Interleaved descents (asynchronous memory access chaining): up to BATCH searches are in flight,
+// each round moves every one of them a level down and prefetches the child it goes to, so by the
+// time a search comes round again its node has arrived. A finished search hands its slot to the
+// next key. visit(i, node) gets the node holding keys[i], nullptr on a miss.
+template <typename Visit>
+void lookup_batch(const key_type *keys, size_type n, Visit visit) const
+{
+    struct Search
+    {
+        Node *node;
+        size_type index;
+    };
+    Search searches[BATCH];
+    size_type active=0;
+    size_type next=0;
+    for(;active<BATCH && next<n;++next)
+        searches[active++]=Search{root,next};
+
+    while(active>0)
+    {
+        for(size_type s=0;s<active;)
+        {
+            Search &search=searches[s];
+            Node *node=search.node;
+            Node *hit=nullptr;
+            const key_type &key=keys[search.index];
+            if(node!=nullptr)
+            {
+                if(Less(key,node->data.first)) node=node->left;
+                else if(Less(node->data.first,key)) node=node->right;
+                else
+                {
+                    hit=node;
+                    node=nullptr;
+                }
+            }
+            if(node!=nullptr)
+            {
+                __builtin_prefetch(node);
+                search.node=node;
+                ++s;
+                continue;
+            }
+            visit(search.index,hit);
+            if(next<n) search=Search{root,next++};
+            else searches[s]=searches[--active];
+        }
+    }
+}
+
 Node* find_node(const key_type& key) const
 {
     Node* node=root;
     while(node!=nullptr)
     {
-        if(key < node->data->first) node=node->left;
-        else if(key > node->data->first) node=node->right;
+        if(Less(key,node->data.first)) node=node->left;
+        else if(Less(node->data.first,key)) node=node->right;
         else break;
     }
     return node;
 }
 
+Node* lower_bound_node(const key_type& key) const
+{
+    Node* node=root;
+    Node* candidate=nullptr;
+    while(node!=nullptr)
+    {
+        if(Less(node->data.first,key)) node=node->right;
+        else
+        {
+            candidate=node;
+            node=node->left;
+        }
+    }
+    return candidate;
+}
+
+Node* upper_bound_node(const key_type& key) const
+{
+    Node* node=root;
+    Node* candidate=nullptr;
+    while(node!=nullptr)
+    {
+        if(Less(key,node->data.first))
+        {
+            candidate=node;
+            node=node->left;
+        }
+        else node=node->right;
+    }
+    return candidate;
+}
+
 Node* find_minimum(Node *node) const
 {
     if(node!=nullptr)
@@ -498,7 +1181,6 @@ Node* next_node(Node *A) const
 
 Node* remove_node(Node *A)
 {
-    Size--;
     Node *tmp;
     Node *B;
     Node *C;
@@ -512,6 +1194,8 @@ Node* remove_node(Node *A)
     }
     else
     {
+        for(Node *P=A->parent;P!=nullptr;P=P->parent)
+            --P->count;
         if(A->left)
         {
         B=A->left;
@@ -519,8 +1203,8 @@ Node* remove_node(Node *A)
         }
         else
         {
-        B=A->left;
-        A->left=nullptr;
+        B=A->right;
+        A->right=nullptr;
         }
         A->balance=0;
         x=true;
@@ -534,6 +1218,7 @@ Node* remove_node(Node *A)
         B->right=A->right;
         if(B->right) B->right->parent=B;
         B->balance=A->balance;
+        if(!x) B->count=A->count;
     }
     if(A->parent)
     {
@@ -545,7 +1230,7 @@ Node* remove_node(Node *A)
     if(x)
     {
         C=B;
-        C=A->parent;
+        B=A->parent;
         while(B)
         {
             if(!B->balance)
@@ -598,20 +1283,21 @@ Node* remove_node(Node *A)
 
 };
 
-template <typename KeyType, typename ValueType>
-class TreeMap<KeyType, ValueType>::ConstIterator
+template <typename KeyType, typename ValueType, typename Compare>
+class TreeMap<KeyType, ValueType, Compare>::ConstIterator
 {
 public:
   using reference = typename TreeMap::const_reference;
   using iterator_category = std::bidirectional_iterator_tag;
   using value_type = typename TreeMap::value_type;
   using pointer = const typename TreeMap::value_type*;
+  using difference_type = std::ptrdiff_t;
 private:
 
   Node *node;
   const TreeMap *tree;
 
-  friend void TreeMap<KeyType, ValueType>::remove(const const_iterator&);
+  friend void TreeMap<KeyType, ValueType, Compare>::remove(const const_iterator&);
 
 public:
   explicit ConstIterator(Node* n=nullptr, const TreeMap *t=nullptr) : node(n), tree(t)
@@ -619,6 +1305,8 @@ public:
 
   ConstIterator(const ConstIterator& other) : ConstIterator(other.node,other.tree) {}
 
+  ConstIterator& operator=(const ConstIterator& other) = default;
+
   ConstIterator& operator++()
   {
     if(node==nullptr)
@@ -657,11 +1345,24 @@ public:
     return tmp;
   }
 
+  // moves by n positions in O(log n) using the subtree sizes
+  ConstIterator& operator+=(difference_type n)
+  {
+    difference_type position=difference_type(tree->node_rank(node))+n;
+    if(position<0 || position>difference_type(tree->Size))
+        throw std::out_of_range("+=");
+    node=tree->select_node(size_type(position));
+    return *this;
+  }
+
+  ConstIterator& operator-=(difference_type n)
+  {
+    return operator+=(-n);
+  }
+
   value_type& getValueType() const
   {
-    value_type *value;
-    value = node->data;
-    return *value;
+    return node->data;
   }
 
   reference operator*() const
@@ -684,7 +1385,7 @@ public:
     else if((node==nullptr && other.node!=nullptr) || (node!=nullptr && other.node==nullptr))
         return false;
 
-    if(node->data==other.node->data && tree==other.tree)
+    if(node==other.node && tree==other.tree)
         return true;
     else
         return false;
@@ -697,8 +1398,8 @@ public:
 };
 
 
-template <typename KeyType, typename ValueType>
-class TreeMap<KeyType, ValueType>::Iterator : public TreeMap<KeyType, ValueType>::ConstIterator
+template <typename KeyType, typename ValueType, typename Compare>
+class TreeMap<KeyType, ValueType, Compare>::Iterator : public TreeMap<KeyType, ValueType, Compare>::ConstIterator
 {
 public:
   using reference = typename TreeMap::reference;
@@ -737,6 +1438,18 @@ public:
     return result;
   }
 
+  Iterator& operator+=(typename ConstIterator::difference_type n)
+  {
+    ConstIterator::operator+=(n);
+    return *this;
+  }
+
+  Iterator& operator-=(typename ConstIterator::difference_type n)
+  {
+    ConstIterator::operator-=(n);
+    return *this;
+  }
+
   pointer operator->() const
   {
     return &this->operator*();
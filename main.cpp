@@ -1,12 +1,24 @@
+#include <algorithm>
 #include <cstddef>
-#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
 #include <string>
-#include<chrono>
-#include<iostream>
-
+#include <vector>
 
+#include "Benchmark.h"
 #include "TreeMap.h"
+#include "BTreeMap.h"
 #include "HashMap.h"
+#include "FlatHashMap.h"
+#include "FrozenTreeMap.h"
+#include "PersistentTreeMap.h"
+#include "ConcurrentHashMap.h"
+#include "ConcurrentTreeMap.h"
+#include "Parallel.h"
 
 namespace
 {
@@ -14,70 +26,520 @@ namespace
 template <typename K, typename V>
 using TreeMap = aisdi::TreeMap<K, V>;
 
+template <typename K, typename V>
+using BTreeMap = aisdi::BTreeMap<K, V>;
+
 template <typename K, typename V>
 using HashMap = aisdi::HashMap<K, V>;
 
-void addTreeMapTest(std::size_t repeatCount)
+template <typename K, typename V>
+using FlatHashMap = aisdi::FlatHashMap<K, V>;
+
+using aisdi::bench::Distribution;
+using aisdi::bench::Runner;
+
+const Distribution distributions[] = {
+  Distribution::Sequential, Distribution::Random, Distribution::Zipfian, Distribution::Adversarial
+};
+
+const char* const scenarios[] = {
+  "insert", "lookup_hit", "lookup_miss", "iterate", "copy", "remove", "mixed_read95", "mixed_read50"
+};
+
+struct MixedOp
 {
-  TreeMap<long int,int> collection;
+  bool read;
+  long key;
+};
+
+// readPercent% valueOf on present keys, the rest writes split between updates and inserts of new keys
+std::vector<MixedOp> mixedOps(const std::vector<long>& probes, const std::vector<long>& misses, unsigned readPercent)
+{
+  std::vector<MixedOp> ops(probes.size());
+  std::mt19937_64 rng(11);
+  for (std::size_t i = 0; i < ops.size(); ++i)
+  {
+    ops[i].read = rng() % 100 < readPercent;
+    ops[i].key = ops[i].read || i % 2 ? probes[i] : misses[i];
+  }
+  return ops;
+}
+
+template <typename Map>
+void benchmarkMap(Runner& runner, const std::string& name, Distribution distribution)
+{
+  const std::string dist = aisdi::bench::name(distribution);
+  bool any = false;
+  for (const char* scenario : scenarios)
+    any = any || runner.enabled(name, scenario, dist);
+  if (!any)
+    return;
+
+  const std::size_t n = runner.settings().keys;
+  const std::vector<long> keys = aisdi::bench::makeKeys(distribution, n);
+  const std::vector<long> probes = aisdi::bench::shuffled(keys);
+  const std::vector<long> misses = aisdi::bench::missKeys(probes);
+
+  Map base;
+  for (std::size_t i = 0; i < n; ++i)
+    base[keys[i]] = i;
+
+  std::vector<long> present;
+  for (auto it = base.begin(); it != base.end(); ++it)
+    present.push_back(it->first);
+  present = aisdi::bench::shuffled(present);
 
-  auto start = std::chrono::system_clock::now();
-  for (std::size_t i = 0; i < repeatCount; ++i)
-     collection[i]=i;
-  auto done = std::chrono::system_clock::now();
-  std::cout<<"TreeMap add time: "<<(done-start).count()<<'\n';
+  Map work;
+  std::unique_ptr<Map> copy;
 
+  runner.run(name, "insert", dist, [&] { work = Map(); }, [&] {
+    for (std::size_t i = 0; i < n; ++i)
+      work[keys[i]] = i;
+    return n;
+  });
+
+  runner.run(name, "lookup_hit", dist, [&] {
+    long sum = 0;
+    for (std::size_t i = 0; i < n; ++i)
+      sum += base.valueOf(probes[i]);
+    aisdi::bench::consume(sum);
+    return n;
+  });
+
+  runner.run(name, "lookup_miss", dist, [&] {
+    std::size_t found = 0;
+    for (std::size_t i = 0; i < n; ++i)
+      found += base.find(misses[i]) != base.end();
+    aisdi::bench::consume(found);
+    return n;
+  });
+
+  runner.run(name, "iterate", dist, [&] {
+    long sum = 0;
+    for (auto it = base.begin(); it != base.end(); ++it)
+      sum += it->second;
+    aisdi::bench::consume(sum);
+    return base.getSize();
+  });
+
+  runner.run(name, "copy", dist, [&] { copy.reset(); }, [&] {
+    copy.reset(new Map(base));
+    return base.getSize();
+  });
+
+  runner.run(name, "remove", dist, [&] { work = base; }, [&] {
+    for (std::size_t i = 0; i < present.size(); ++i)
+      work.remove(present[i]);
+    return present.size();
+  });
+
+  const unsigned readPercents[] = { 95, 50 };
+  for (unsigned readPercent : readPercents)
+  {
+    const std::string scenario = "mixed_read" + std::to_string(readPercent);
+    if (!runner.enabled(name, scenario, dist))
+      continue;
+    const std::vector<MixedOp> ops = mixedOps(probes, misses, readPercent);
+    runner.run(name, scenario, dist, [&] { work = base; }, [&] {
+      long sum = 0;
+      for (std::size_t i = 0; i < ops.size(); ++i)
+      {
+        if (ops[i].read)
+          sum += work.valueOf(ops[i].key);
+        else
+          work[ops[i].key] = i;
+      }
+      aisdi::bench::consume(sum);
+      return ops.size();
+    });
+  }
 }
 
-void addHashMapTest(std::size_t repeatCount)
+// valueOfBatch over the same probes as lookup_hit, BATCH keys per call
+template <typename Map>
+void benchmarkBatch(Runner& runner, const std::string& name, Distribution distribution)
 {
-  HashMap<long int,int> collection1;
+  const std::string dist = aisdi::bench::name(distribution);
+  if (!runner.enabled(name, "lookup_batch", dist))
+    return;
+
+  const std::size_t BATCH = 256;
+  const std::size_t n = runner.settings().keys;
+  const std::vector<long> keys = aisdi::bench::makeKeys(distribution, n);
+  const std::vector<long> probes = aisdi::bench::shuffled(keys);
+
+  Map base;
+  for (std::size_t i = 0; i < n; ++i)
+    base[keys[i]] = i;
 
-  auto start = std::chrono::system_clock::now();
-  for (std::size_t i = 0; i < repeatCount; ++i)
-    collection1[i]=i;
-  auto done = std::chrono::system_clock::now();
-  std::cout<<"HashMap add time: "<<(done-start).count()<<'\n';
+  std::vector<long> values(BATCH);
+  std::unique_ptr<bool[]> found(new bool[BATCH]);
+  runner.run(name, "lookup_batch", dist, [&] {
+    long sum = 0;
+    for (std::size_t i = 0; i < n; i += BATCH)
+    {
+      std::size_t count = std::min(BATCH, n - i);
+      base.valueOfBatch(probes.data() + i, count, values.data(), found.get());
+      for (std::size_t j = 0; j < count; ++j)
+        sum += values[j];
+    }
+    aisdi::bench::consume(sum);
+    return n;
+  });
 }
 
+// the insert scenario's keys loaded by one insertRange call on 1, 2, 4, ... --threads threads
+template <typename Map>
+void benchmarkInsertRange(Runner& runner, const std::string& name, Distribution distribution)
+{
+  const std::string dist = aisdi::bench::name(distribution);
+  const std::size_t n = runner.settings().keys;
+  std::vector<std::pair<long, long>> pairs;
+
+  for (std::size_t threads : aisdi::bench::threadCounts(runner.settings().threads))
+  {
+    const std::string scenario = "insert_range_t" + std::to_string(threads);
+    if (!runner.enabled(name, scenario, dist))
+      continue;
+    if (pairs.empty())
+    {
+      const std::vector<long> keys = aisdi::bench::makeKeys(distribution, n);
+      for (std::size_t i = 0; i < n; ++i)
+        pairs.emplace_back(keys[i], long(i));
+    }
+    Map work;
+    runner.run(name, scenario, dist, [&] { work = Map(); }, [&] {
+      work.insertRange(pairs.begin(), pairs.end(), unsigned(threads));
+      return n;
+    });
+  }
+}
+
+// the iterate scenario's sum of all values through parallelReduce on pools of 1, 2, 4, ... --threads workers
+template <typename Map>
+void benchmarkParallelScan(Runner& runner, const std::string& name, Distribution distribution)
+{
+  const std::string dist = aisdi::bench::name(distribution);
+  const std::size_t n = runner.settings().keys;
+  std::unique_ptr<Map> base;
+
+  for (std::size_t threads : aisdi::bench::threadCounts(runner.settings().threads))
+  {
+    const std::string scenario = "parallel_sum_t" + std::to_string(threads);
+    if (!runner.enabled(name, scenario, dist))
+      continue;
+    if (!base)
+    {
+      const std::vector<long> keys = aisdi::bench::makeKeys(distribution, n);
+      base.reset(new Map);
+      for (std::size_t i = 0; i < n; ++i)
+        (*base)[keys[i]] = i;
+    }
+    aisdi::ThreadPool pool(static_cast<unsigned>(threads));
+    runner.run(name, scenario, dist, [&] {
+      long sum = aisdi::parallelReduce(*base, 0L,
+        [](const typename Map::value_type& element) { return element.second; },
+        [](long a, long b) { return a + b; }, pool);
+      aisdi::bench::consume(sum);
+      return base->getSize();
+    });
+  }
+}
 
-void valueOfTreeMapTest(std::size_t repeatCount)
+// cache layer lookups, 40% of them misses: valueOf with the miss caught, against tryGet
+template <typename Map>
+void benchmarkMissHeavy(Runner& runner, const std::string& name, Distribution distribution)
 {
-    TreeMap<long int,int> collection;
+  const std::string dist = aisdi::bench::name(distribution);
+  if (!runner.enabled(name, "miss40_valueOf", dist) && !runner.enabled(name, "miss40_tryGet", dist))
+    return;
 
-    for (std::size_t i = 0; i < repeatCount; ++i)
-        collection[i]=i;
+  const std::size_t n = runner.settings().keys;
+  const std::vector<long> keys = aisdi::bench::makeKeys(distribution, n);
+  const std::vector<long> probes = aisdi::bench::shuffled(keys);
+  const std::vector<long> misses = aisdi::bench::missKeys(probes);
 
-    auto start = std::chrono::system_clock::now();
-    for (std::size_t i = 0; i < repeatCount; ++i)
-        collection.valueOf(i);
-    auto done = std::chrono::system_clock::now();
-    std::cout<<"TreeMap valueOf time: "<<(done-start).count()<<'\n';
+  Map base;
+  for (std::size_t i = 0; i < n; ++i)
+    base[keys[i]] = i;
+
+  std::vector<long> lookups(n);
+  std::mt19937_64 rng(13);
+  for (std::size_t i = 0; i < n; ++i)
+    lookups[i] = rng() % 100 < 40 ? misses[i] : probes[i];
+
+  runner.run(name, "miss40_valueOf", dist, [&] {
+    long sum = 0;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      try
+      {
+        sum += base.valueOf(lookups[i]);
+      }
+      catch (const std::out_of_range&)
+      {
+        --sum;
+      }
+    }
+    aisdi::bench::consume(sum);
+    return n;
+  });
+
+  runner.run(name, "miss40_tryGet", dist, [&] {
+    long sum = 0;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      const long* value = base.tryGet(lookups[i]);
+      sum += value ? *value : -1;
+    }
+    aisdi::bench::consume(sum);
+    return n;
+  });
+}
+
+// read-only scenarios for FrozenTreeMap, plus "freeze" timing its construction from a TreeMap
+void benchmarkFrozen(Runner& runner, const std::string& name, Distribution distribution)
+{
+  const std::string dist = aisdi::bench::name(distribution);
+  const char* const frozenScenarios[] = { "freeze", "lookup_hit", "lookup_miss", "iterate" };
+  bool any = false;
+  for (const char* scenario : frozenScenarios)
+    any = any || runner.enabled(name, scenario, dist);
+  if (!any)
+    return;
+
+  const std::size_t n = runner.settings().keys;
+  const std::vector<long> keys = aisdi::bench::makeKeys(distribution, n);
+  const std::vector<long> probes = aisdi::bench::shuffled(keys);
+  const std::vector<long> misses = aisdi::bench::missKeys(probes);
+
+  TreeMap<long, long> tree;
+  for (std::size_t i = 0; i < n; ++i)
+    tree[keys[i]] = i;
+  const aisdi::FrozenTreeMap<long, long> base(tree);
+  std::unique_ptr<aisdi::FrozenTreeMap<long, long>> frozen;
+
+  runner.run(name, "freeze", dist, [&] { frozen.reset(); }, [&] {
+    frozen.reset(new aisdi::FrozenTreeMap<long, long>(tree));
+    return tree.getSize();
+  });
+
+  runner.run(name, "lookup_hit", dist, [&] {
+    long sum = 0;
+    for (std::size_t i = 0; i < n; ++i)
+      sum += base.valueOf(probes[i]);
+    aisdi::bench::consume(sum);
+    return n;
+  });
+
+  runner.run(name, "lookup_miss", dist, [&] {
+    std::size_t found = 0;
+    for (std::size_t i = 0; i < n; ++i)
+      found += base.find(misses[i]) != base.end();
+    aisdi::bench::consume(found);
+    return n;
+  });
+
+  runner.run(name, "iterate", dist, [&] {
+    long sum = 0;
+    for (auto it = base.begin(); it != base.end(); ++it)
+      sum += it->second;
+    aisdi::bench::consume(sum);
+    return base.getSize();
+  });
+}
+
+// PersistentTreeMap: the usual scenarios, "snapshot" to compare with TreeMap's copy, and
+// "snapshot_write", a write after every snapshot while the last SNAPSHOTS versions are kept alive
+void benchmarkPersistent(Runner& runner, const std::string& name, Distribution distribution)
+{
+  using Map = aisdi::PersistentTreeMap<long, long>;
+  const std::size_t SNAPSHOTS = 16;
+  const std::string dist = aisdi::bench::name(distribution);
+  const char* const persistentScenarios[] = { "insert", "lookup_hit", "iterate", "snapshot", "snapshot_write" };
+  bool any = false;
+  for (const char* scenario : persistentScenarios)
+    any = any || runner.enabled(name, scenario, dist);
+  if (!any)
+    return;
+
+  const std::size_t n = runner.settings().keys;
+  const std::vector<long> keys = aisdi::bench::makeKeys(distribution, n);
+  const std::vector<long> probes = aisdi::bench::shuffled(keys);
+
+  Map base;
+  for (std::size_t i = 0; i < n; ++i)
+    base.insert_or_assign(keys[i], long(i));
+
+  Map work;
+  std::unique_ptr<Map> snapshot;
+  std::vector<Map> versions(SNAPSHOTS);
+
+  runner.run(name, "insert", dist, [&] { work = Map(); }, [&] {
+    for (std::size_t i = 0; i < n; ++i)
+      work.insert_or_assign(keys[i], long(i));
+    return n;
+  });
+
+  runner.run(name, "lookup_hit", dist, [&] {
+    long sum = 0;
+    for (std::size_t i = 0; i < n; ++i)
+      sum += base.valueOf(probes[i]);
+    aisdi::bench::consume(sum);
+    return n;
+  });
+
+  runner.run(name, "iterate", dist, [&] {
+    long sum = 0;
+    for (auto it = base.begin(); it != base.end(); ++it)
+      sum += it->second;
+    aisdi::bench::consume(sum);
+    return base.getSize();
+  });
+
+  runner.run(name, "snapshot", dist, [&] { snapshot.reset(); }, [&] {
+    snapshot.reset(new Map(base.snapshot()));
+    return base.getSize();
+  });
+
+  runner.run(name, "snapshot_write", dist, [&] {
+    work = base;
+    versions.assign(SNAPSHOTS, Map());
+  }, [&] {
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      versions[i % SNAPSHOTS] = work.snapshot();
+      work.insert_or_assign(probes[i], long(i));
+    }
+    return n;
+  });
 }
 
-void valueOfHashMapTest(std::size_t repeatCount)
+// global mutex around a map, what callers had to do before ConcurrentHashMap and ConcurrentTreeMap
+template <typename Map>
+class MutexMap
 {
-    HashMap<long int,int> collection;
+public:
 
-    for (std::size_t i = 0; i < repeatCount; ++i)
-        collection[i]=i;
+  bool find(long key, long& value) const
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = map.find(key);
+    if (it == map.end())
+      return false;
+    value = it->second;
+    return true;
+  }
 
-    auto start = std::chrono::system_clock::now();
-    for (std::size_t i = 0; i < repeatCount; ++i)
-        collection.valueOf(i);
-    auto done = std::chrono::system_clock::now();
-    std::cout<<"HashMap valueOf time: "<<(done-start).count()<<'\n';
+  void insert_or_assign(long key, long value)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    map[key] = value;
+  }
+
+private:
+  mutable std::mutex lock;
+  Map map;
+};
+
+using MutexHashMap = MutexMap<HashMap<long, long>>;
+using MutexTreeMap = MutexMap<TreeMap<long, long>>;
+
+// readPercent% lookups of present keys, the rest insert_or_assign; every thread takes its own slice of ops
+template <typename Map, typename Find>
+void benchmarkScaling(Runner& runner, const std::string& name, unsigned readPercent, Find find)
+{
+  const std::size_t n = runner.settings().keys;
+  const std::vector<long> keys = aisdi::bench::makeKeys(Distribution::Random, n);
+  const std::vector<MixedOp> ops = mixedOps(aisdi::bench::shuffled(keys), aisdi::bench::missKeys(keys), readPercent);
+
+  for (std::size_t threads : aisdi::bench::threadCounts(runner.settings().threads))
+  {
+    const std::string scenario = "read" + std::to_string(readPercent) + "_t" + std::to_string(threads);
+    if (!runner.enabled(name, scenario, "random"))
+      continue;
+    std::unique_ptr<Map> map;
+    runner.run(name, scenario, "random", [&] {
+      map.reset(new Map);
+      for (std::size_t i = 0; i < n; ++i)
+        map->insert_or_assign(keys[i], long(i));
+    }, [&] {
+      aisdi::bench::runThreads(threads, [&](std::size_t t) {
+        long sum = 0;
+        for (std::size_t i = t; i < ops.size(); i += threads)
+        {
+          if (ops[i].read)
+            sum += find(*map, ops[i].key);
+          else
+            map->insert_or_assign(ops[i].key, long(i));
+        }
+        aisdi::bench::consume(sum);
+      });
+      return ops.size();
+    });
+  }
 }
 
 } // namespace
 
 int main(int argc, char** argv)
 {
-  const std::size_t repeatCount = argc > 1 ? std::atoll(argv[1]) : 10000;
-  addTreeMapTest(repeatCount);
-  addHashMapTest(repeatCount);
-  valueOfTreeMapTest(repeatCount);
-  valueOfHashMapTest(repeatCount);
+  aisdi::bench::Options options;
+  try
+  {
+    options = aisdi::bench::parseOptions(argc, argv);
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << e.what() << "\nusage: " << argv[0]
+              << " [keys] [--keys=N] [--reps=N] [--warmup=N] [--threads=N] [--format=text|csv|json] [--filter=map/scenario/distribution]\n";
+    return 1;
+  }
+
+  Runner runner(options, std::cout);
+  for (Distribution distribution : distributions)
+  {
+    benchmarkMap<TreeMap<long, long>>(runner, "TreeMap", distribution);
+    benchmarkBatch<TreeMap<long, long>>(runner, "TreeMap", distribution);
+    benchmarkMissHeavy<TreeMap<long, long>>(runner, "TreeMap", distribution);
+    benchmarkParallelScan<TreeMap<long, long>>(runner, "TreeMap", distribution);
+    benchmarkFrozen(runner, "FrozenTreeMap", distribution);
+    benchmarkPersistent(runner, "PersistentTreeMap", distribution);
+    benchmarkMap<BTreeMap<long, long>>(runner, "BTreeMap", distribution);
+    benchmarkMap<HashMap<long, long>>(runner, "HashMap", distribution);
+    benchmarkBatch<HashMap<long, long>>(runner, "HashMap", distribution);
+    benchmarkInsertRange<HashMap<long, long>>(runner, "HashMap", distribution);
+    benchmarkMissHeavy<HashMap<long, long>>(runner, "HashMap", distribution);
+    benchmarkParallelScan<HashMap<long, long>>(runner, "HashMap", distribution);
+    benchmarkMap<FlatHashMap<long, long>>(runner, "FlatHashMap", distribution);
+  }
+
+  const unsigned readPercents[] = { 90, 50 };
+  for (unsigned readPercent : readPercents)
+  {
+    benchmarkScaling<aisdi::ConcurrentHashMap<long, long>>(runner, "ConcurrentHashMap", readPercent,
+      [](const aisdi::ConcurrentHashMap<long, long>& map, long key) {
+        long value = 0;
+        map.find(key, [&](long v) { value = v; });
+        return value;
+      });
+    benchmarkScaling<MutexHashMap>(runner, "MutexHashMap", readPercent, [](const MutexHashMap& map, long key) {
+      long value = 0;
+      map.find(key, value);
+      return value;
+    });
+    benchmarkScaling<aisdi::ConcurrentTreeMap<long, long>>(runner, "ConcurrentTreeMap", readPercent,
+      [](const aisdi::ConcurrentTreeMap<long, long>& map, long key) {
+        long value = 0;
+        map.find(key, [&](long v) { value = v; });
+        return value;
+      });
+    benchmarkScaling<MutexTreeMap>(runner, "MutexTreeMap", readPercent, [](const MutexTreeMap& map, long key) {
+      long value = 0;
+      map.find(key, value);
+      return value;
+    });
+  }
 
   return 0;
 }
@@ -0,0 +1,64 @@
+// insertRange() over keys already in the map, while a rehash started by the inserts before it is
+// still moving buckets out of the old table; every key must end up once, with the new value
+#include <cstddef>
+#include <iostream>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "HashMap.h"
+
+namespace
+{
+
+bool check(bool condition, const char* what)
+{
+  if (!condition)
+    std::cerr << "FAILED: " << what << "\n";
+  return condition;
+}
+
+bool overlapDuringRehash(unsigned threads)
+{
+  const long OLD_KEYS = 65537; // the last insert grows the table and leaves the rehash pending
+  const long NEW_KEYS = 40000; // above PARALLEL_MIN, so insertRange partitions the table
+
+  aisdi::HashMap<long, long> map;
+  for (long i = 0; i < OLD_KEYS; ++i)
+    map[i] = i;
+
+  std::vector<std::pair<long, long>> pairs;
+  for (long k = 0; k < NEW_KEYS; ++k)
+    pairs.emplace_back(k, -k);
+  map.insertRange(pairs.begin(), pairs.end(), threads);
+
+  std::set<long> seen;
+  std::size_t visited = 0;
+  bool ok = true;
+  for (auto it = map.begin(); it != map.end(); ++it)
+  {
+    seen.insert(it->first);
+    ++visited;
+    long expected = it->first < NEW_KEYS ? -it->first : it->first;
+    ok = ok && it->second == expected;
+  }
+
+  bool passed = check(map.getSize() == std::size_t(OLD_KEYS), "getSize() counts every key once");
+  passed = check(visited == std::size_t(OLD_KEYS), "iteration visits every key once") && passed;
+  passed = check(seen.size() == std::size_t(OLD_KEYS), "no key is missing") && passed;
+  passed = check(ok, "insertRange() values replace the old ones") && passed;
+  return passed;
+}
+
+} // namespace
+
+int main()
+{
+  bool passed = true;
+  const unsigned threadCounts[] = { 1, 4 };
+  for (unsigned threads : threadCounts)
+    passed = overlapDuringRehash(threads) && passed;
+  if (passed)
+    std::cout << "ok\n";
+  return passed ? 0 : 1;
+}